@@ -50,6 +50,126 @@ gboolean gs_dirfd_iterator_next_dent (GSDirFdIterator  *dfd_iter,
 #endif
 void gs_dirfd_iterator_clear (GSDirFdIterator *dfd_iter);
 
+/**
+ * GSDirFdEntry:
+ * @ino: Inode number
+ * @off: Opaque position of the next entry
+ * @reclen: Size of this record, including padding
+ * @type: File type, as for #struct dirent's d_type (may be DT_UNKNOWN)
+ * @name: Nul-terminated file name
+ *
+ * One record in a batch from gs_dirfd_iterator_next_batch(); this is
+ * the layout of the kernel's struct linux_dirent64.
+ */
+typedef struct {
+  guint64 ino;
+  gint64 off;
+  guint16 reclen;
+  guint8 type;
+  char name[];
+} GSDirFdEntry;
+
+#define GS_DIRFD_ENTRY_NEXT(entry) ((GSDirFdEntry *) ((char *) (entry) + (entry)->reclen))
+
+gboolean gs_dirfd_iterator_next_batch (GSDirFdIterator  *dfd_iter,
+                                       gpointer          buf,
+                                       gsize             buf_size,
+                                       gsize            *out_len,
+                                       GCancellable     *cancellable,
+                                       GError          **error);
+
+/**
+ * GSStatMask:
+ * @GS_STAT_TYPE: File type bits of @mode
+ * @GS_STAT_MODE: Permission bits of @mode
+ * @GS_STAT_NLINK: @nlink
+ * @GS_STAT_UID: @uid
+ * @GS_STAT_GID: @gid
+ * @GS_STAT_ATIME: @atime
+ * @GS_STAT_MTIME: @mtime
+ * @GS_STAT_CTIME: @ctime
+ * @GS_STAT_INO: @ino
+ * @GS_STAT_SIZE: @size
+ * @GS_STAT_BLOCKS: @blocks
+ * @GS_STAT_BASIC: Everything in struct stat
+ * @GS_STAT_BTIME: @btime
+ *
+ * Fields of a #GSStat.  The values match the kernel's STATX_ flags.
+ */
+typedef enum {
+  GS_STAT_TYPE = 0x0001,
+  GS_STAT_MODE = 0x0002,
+  GS_STAT_NLINK = 0x0004,
+  GS_STAT_UID = 0x0008,
+  GS_STAT_GID = 0x0010,
+  GS_STAT_ATIME = 0x0020,
+  GS_STAT_MTIME = 0x0040,
+  GS_STAT_CTIME = 0x0080,
+  GS_STAT_INO = 0x0100,
+  GS_STAT_SIZE = 0x0200,
+  GS_STAT_BLOCKS = 0x0400,
+  GS_STAT_BASIC = 0x07ff,
+  GS_STAT_BTIME = 0x0800
+} GSStatMask;
+
+typedef struct {
+  gint64 sec;
+  guint32 nsec;
+} GSStatTime;
+
+/**
+ * GSStat:
+ * @mask: The #GSStatMask fields that are valid
+ * @mode: File type and permissions, as for st_mode
+ * @nlink: Number of hardlinks
+ * @uid: Owner
+ * @gid: Group
+ * @ino: Inode number
+ * @dev: Device of the filesystem; always valid
+ * @rdev: Device, for device nodes; always valid
+ * @size: Size in bytes
+ * @blocks: Number of 512-byte blocks allocated
+ * @atime: Last access
+ * @mtime: Last modification
+ * @ctime: Last status change
+ * @btime: Creation
+ *
+ * Metadata of a file, filled by gs_stat_at().  Only the fields in
+ * @mask are meaningful; the rest are zero.
+ */
+typedef struct {
+  guint32 mask;
+  guint32 mode;
+  guint32 nlink;
+  guint32 uid;
+  guint32 gid;
+  guint64 ino;
+  guint64 dev;
+  guint64 rdev;
+  guint64 size;
+  guint64 blocks;
+  GSStatTime atime;
+  GSStatTime mtime;
+  GSStatTime ctime;
+  GSStatTime btime;
+} GSStat;
+
+gboolean gs_stat_at (int          dfd,
+                     const char  *name,
+                     int          flags,
+                     GSStatMask   mask,
+                     GSStat      *out_stat,
+                     GError     **error);
+
+#ifndef __GI_SCANNER__
+gboolean gs_dirfd_iterator_next_stat (GSDirFdIterator  *dfd_iter,
+                                      GSStatMask        mask,
+                                      struct dirent   **out_dent,
+                                      GSStat           *out_stat,
+                                      GCancellable     *cancellable,
+                                      GError          **error);
+#endif
+
 #define gs_dirfd_iterator_cleanup __attribute__((cleanup(gs_dirfd_iterator_clear)))
 
 
@@ -59,6 +179,15 @@ gboolean gs_file_enumerator_iterate (GFileEnumerator  *direnum,
                                      GCancellable     *cancellable,
                                      GError          **error);
 
+gboolean gs_file_enumerator_iterate_batch (GFileEnumerator  *direnum,
+                                           guint             n_wanted,
+                                           GPtrArray       **out_infos,
+                                           GCancellable     *cancellable,
+                                           GError          **error);
+
+GFile *gs_file_enumerator_get_child (GFileEnumerator  *direnum,
+                                     GFileInfo        *info);
+
 gboolean gs_file_openat_noatime (int            dfd,
                                  const char    *name,
                                  int           *ret_fd,
@@ -90,9 +219,34 @@ gboolean gs_file_sync_data (GFile          *file,
                             GCancellable   *cancellable,
                             GError        **error);
 
+gboolean gs_fd_sync_filesystem (int            fd,
+                                GCancellable  *cancellable,
+                                GError       **error);
+
+void gs_fd_start_writeback (int fd);
+
+gboolean gs_fd_copy_data (int            src_fd,
+                          int            dest_fd,
+                          GCancellable  *cancellable,
+                          GError       **error);
+
 char * gs_fileutil_gen_tmp_name (const char *prefix,
                                  const char *suffix);
 
+/**
+ * GS_FILEUTIL_TMP_NAME_MAX:
+ *
+ * A buffer size for gs_fileutil_gen_tmp_name_buf() that fits any name
+ * usable as a filename, including every name made with the default
+ * prefix and suffix.
+ */
+#define GS_FILEUTIL_TMP_NAME_MAX 256
+
+gboolean gs_fileutil_gen_tmp_name_buf (const char *prefix,
+                                       const char *suffix,
+                                       char       *buf,
+                                       gsize       buf_size);
+
 gboolean gs_file_open_dir_fd (GFile         *path,
                               int           *out_fd,
                               GCancellable  *cancellable,
@@ -146,11 +300,67 @@ gboolean gs_file_linkcopy_sync_data (GFile          *src,
                                      GCancellable   *cancellable,
                                      GError        **error);
 
+gboolean gs_file_linkcopy_deferred_sync (GFile          *src,
+                                         GFile          *dest,
+                                         GFileCopyFlags  flags,
+                                         GCancellable   *cancellable,
+                                         GError        **error);
+
+gboolean gs_file_linkcopy_at (int              src_dfd,
+                              const char      *src_name,
+                              int              dest_dfd,
+                              const char      *dest_name,
+                              GFileCopyFlags   flags,
+                              GCancellable    *cancellable,
+                              GError         **error);
+
 gboolean gs_file_rename (GFile          *from,
                          GFile          *to,
                          GCancellable   *cancellable,
                          GError        **error);
 
+/**
+ * GSRenameFlags:
+ * @GS_RENAME_NONE: Replace any existing destination, as rename() does
+ * @GS_RENAME_NOREPLACE: Fail with %G_IO_ERROR_EXISTS if the destination exists
+ * @GS_RENAME_EXCHANGE: Atomically swap the source and the destination, which must both exist
+ *
+ * Flags for gs_renameat().  The values match the kernel's RENAME_
+ * flags.
+ */
+typedef enum {
+  GS_RENAME_NONE = 0,
+  GS_RENAME_NOREPLACE = (1 << 0),
+  GS_RENAME_EXCHANGE = (1 << 1)
+} GSRenameFlags;
+
+int gs_renameat_with_errno (int             old_dfd,
+                            const char     *old_path,
+                            int             new_dfd,
+                            const char     *new_path,
+                            GSRenameFlags   flags);
+gboolean gs_renameat (int             old_dfd,
+                      const char     *old_path,
+                      int             new_dfd,
+                      const char     *new_path,
+                      GSRenameFlags   flags,
+                      GError        **error);
+
+gboolean gs_file_open_anonymous_at (int            dfd,
+                                    int            mode,
+                                    int           *out_fd,
+                                    char         **out_tmp_name,
+                                    GCancellable  *cancellable,
+                                    GError       **error);
+
+gboolean gs_file_commit_anonymous_at (int            dfd,
+                                      int            fd,
+                                      const char    *tmp_name,
+                                      const char    *target,
+                                      GSRenameFlags  flags,
+                                      GCancellable  *cancellable,
+                                      GError       **error);
+
 gboolean gs_file_unlink (GFile          *path,
                          GCancellable   *cancellable,
                          GError        **error);
@@ -223,6 +433,11 @@ gboolean gs_file_set_all_xattrs (GFile         *file,
                                  GCancellable  *cancellable,
                                  GError       **error);
 
+gboolean gs_fd_copy_all_xattrs (int            src_fd,
+                                int            dest_fd,
+                                GCancellable  *cancellable,
+                                GError       **error);
+
 
 G_END_DECLS
 
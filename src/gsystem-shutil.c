@@ -32,9 +32,16 @@
 #include <sys/stat.h>
 #include <dirent.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
 
 #define _GSYSTEM_NO_LOCAL_ALLOC
 #include "libgsystem.h"
+#include "gsystem-file-utils-private.h"
 
 /* Taken from systemd/src/shared/util.h */
 union dirent_storage {
@@ -43,260 +50,4610 @@ union dirent_storage {
                         ((NAME_MAX + 1 + sizeof(long)) & ~(sizeof(long) - 1))];
 };
 
+/* Workers merge their counts into the shared #GSShutilProgress at
+ * most this often, so that counting needs no locking.
+ */
+#define GS_PROGRESS_FLUSH_USEC (50 * 1000)
+
+struct _GSShutilProgress {
+  gint64 interval_usec;
+  GSShutilProgressFunc func;
+  gpointer user_data;
+
+  GMutex lock;
+  GSShutilStats stats;
+  gint64 last_report;
+  gint phase;  /* GSShutilPhase, or -1 */
+  gint64 phase_start;
+};
+
+static void
+stats_add (GSShutilStats       *stats,
+           const GSShutilStats *delta)
+{
+  guint i;
+
+  stats->n_directories += delta->n_directories;
+  stats->n_files += delta->n_files;
+  stats->n_hardlinked += delta->n_hardlinked;
+  stats->n_copied += delta->n_copied;
+  stats->n_skipped += delta->n_skipped;
+  stats->n_deleted += delta->n_deleted;
+  stats->n_bytes += delta->n_bytes;
+  stats->data_usec += delta->data_usec;
+  for (i = 0; i < GS_SHUTIL_N_PHASES; i++)
+    stats->phase_usec[i] += delta->phase_usec[i];
+}
+
+/**
+ * gs_shutil_progress_new:
+ * @interval_ms: Minimum time between calls to @func
+ * @func: (allow-none): Progress callback
+ * @user_data: User data for @func
+ *
+ * Create an object to collect #GSShutilStats from operations such as
+ * gs_shutil_cp_a_parallel(), and optionally report them through
+ * @func.  It may be reused for several operations, in which case the
+ * totals accumulate.
+ *
+ * Returns: (transfer full): A new progress object
+ */
+GSShutilProgress *
+gs_shutil_progress_new (guint                 interval_ms,
+                        GSShutilProgressFunc  func,
+                        gpointer              user_data)
+{
+  GSShutilProgress *progress = g_new0 (GSShutilProgress, 1);
+  progress->interval_usec = (gint64) interval_ms * 1000;
+  progress->func = func;
+  progress->user_data = user_data;
+  g_mutex_init (&progress->lock);
+  progress->phase = -1;
+  return progress;
+}
+
+/**
+ * gs_shutil_progress_free:
+ * @progress: A progress object
+ *
+ * Free @progress; it must not be in use by an operation.
+ */
+void
+gs_shutil_progress_free (GSShutilProgress *progress)
+{
+  g_mutex_clear (&progress->lock);
+  g_free (progress);
+}
+
+static void
+progress_snapshot_unlocked (GSShutilProgress *progress,
+                            gint64            now,
+                            GSShutilStats    *out_stats)
+{
+  *out_stats = progress->stats;
+  if (progress->phase != -1)
+    out_stats->phase_usec[progress->phase] += now - progress->phase_start;
+}
+
+/**
+ * gs_shutil_progress_get_stats:
+ * @progress: A progress object
+ * @out_stats: (out): Return location for the totals
+ *
+ * Get the totals so far.  While an operation is running, recent work
+ * of its threads may not be included yet.
+ */
+void
+gs_shutil_progress_get_stats (GSShutilProgress *progress,
+                              GSShutilStats    *out_stats)
+{
+  g_mutex_lock (&progress->lock);
+  progress_snapshot_unlocked (progress, g_get_monotonic_time (), out_stats);
+  g_mutex_unlock (&progress->lock);
+}
+
+/* Add @delta (and clear it), and call the callback if it is due */
+static void
+progress_merge (GSShutilProgress  *progress,
+                GSShutilStats     *delta,
+                gboolean           force)
+{
+  gint64 now = g_get_monotonic_time ();
+
+  g_mutex_lock (&progress->lock);
+  stats_add (&progress->stats, delta);
+  memset (delta, 0, sizeof (*delta));
+  if (progress->func &&
+      (force || now - progress->last_report >= progress->interval_usec))
+    {
+      GSShutilStats snapshot;
+
+      progress_snapshot_unlocked (progress, now, &snapshot);
+      progress->last_report = now;
+      progress->func (&snapshot, progress->user_data);
+    }
+  g_mutex_unlock (&progress->lock);
+}
+
+/* Switch to @phase, or with -1, end the current one and report */
+static void
+progress_set_phase (GSShutilProgress *progress,
+                    gint              phase)
+{
+  GSShutilStats empty = { 0, };
+  gint64 now;
+
+  if (progress == NULL)
+    return;
+
+  now = g_get_monotonic_time ();
+  g_mutex_lock (&progress->lock);
+  if (progress->phase != -1)
+    progress->stats.phase_usec[progress->phase] += now - progress->phase_start;
+  progress->phase = phase;
+  progress->phase_start = now;
+  g_mutex_unlock (&progress->lock);
+
+  if (phase == -1)
+    progress_merge (progress, &empty, TRUE);
+}
+
+/* Beyond this many queued tasks per worker, work is done inline by
+ * the thread that found it; every queued task holds open file
+ * descriptors.
+ */
+#define GS_POOL_MAX_QUEUED_PER_WORKER 8
+
+/* Work done inline may itself recurse inline, but only this deep;
+ * below that, subtrees are walked with a #GSTreeWalker instead, whose
+ * stack and file descriptor use do not grow with depth.
+ */
+#define GS_POOL_MAX_INLINE_DEPTH 16
+
+/* Directories that stay open while others are deleted below them,
+ * such as each one of a deep chain queued level by level, are capped
+ * at this many per worker.
+ */
+#define GS_POOL_MAX_HELD_PER_WORKER 8
+
+/* Most directories each #GSTreeWalker used here holds open */
+#define GS_SHUTIL_WALK_MAX_FDS 16
+
+typedef struct _GsPool GsPool;
+typedef struct _GsPoolWorker GsPoolWorker;
+typedef struct _GsPoolTask GsPoolTask;
+
+typedef gboolean (*GsPoolTaskRunFunc) (GsPoolTask    *task,
+                                       GsPoolWorker  *worker,
+                                       GCancellable  *cancellable,
+                                       GError       **error);
+
+/* Embedded as the first member of each kind of task */
+struct _GsPoolTask {
+  GsPoolTaskRunFunc run;
+  GDestroyNotify destroy;
+};
+
+struct _GsPoolWorker {
+  GsPool *pool;
+  guint index;
+  GThread *thread;
+  /* Owner pushes and pops at the head, thieves take from the tail */
+  GMutex lock;
+  GQueue tasks;
+  /* Not yet merged into the pool's progress */
+  GSShutilStats stats;
+  gint64 stats_flushed;
+  guint inline_depth;
+};
+
+/* A small work-stealing thread pool, shared by the parallel tree
+ * operations below.  Tasks may push further tasks from their own
+ * worker; the pool is done once nothing is queued or running.  The
+ * first error wins, and makes the remaining tasks bail out early.
+ */
+struct _GsPool {
+  GCancellable *cancellable;
+  GSShutilProgress *progress;
+  guint n_workers;
+  GsPoolWorker *workers;
+  volatile gint n_queued;
+  volatile gint n_held;  /* See GS_POOL_MAX_HELD_PER_WORKER */
+  volatile gint failed;
+
+  GMutex lock;
+  GCond cond;
+  guint n_pending;  /* Queued or running */
+  GError *error;
+};
+
 static gboolean
-copy_xattrs_from_file_to_fd (GFile         *src,
-                             int            dest_fd,
-                             GCancellable  *cancellable,
-                             GError       **error)
+pool_can_push (GsPool *pool)
+{
+  return g_atomic_int_get (&pool->n_queued) <
+    (gint) (pool->n_workers * GS_POOL_MAX_QUEUED_PER_WORKER);
+}
+
+static void
+pool_push (GsPoolWorker *worker,
+           GsPoolTask   *task)
+{
+  GsPool *pool = worker->pool;
+
+  g_mutex_lock (&worker->lock);
+  g_queue_push_head (&worker->tasks, task);
+  g_mutex_unlock (&worker->lock);
+
+  g_atomic_int_inc (&pool->n_queued);
+
+  g_mutex_lock (&pool->lock);
+  pool->n_pending++;
+  g_cond_signal (&pool->cond);
+  g_mutex_unlock (&pool->lock);
+}
+
+static GsPoolTask *
+pool_pop (GsPoolWorker *worker)
+{
+  GsPool *pool = worker->pool;
+  GsPoolTask *task;
+  guint i;
+
+  g_mutex_lock (&worker->lock);
+  task = g_queue_pop_head (&worker->tasks);
+  g_mutex_unlock (&worker->lock);
+
+  /* Steal the oldest task of another worker; that is the one nearest
+   * the root, and so likely the largest subtree.
+   */
+  for (i = 1; task == NULL && i < pool->n_workers; i++)
+    {
+      GsPoolWorker *victim = &pool->workers[(worker->index + i) % pool->n_workers];
+
+      g_mutex_lock (&victim->lock);
+      task = g_queue_pop_tail (&victim->tasks);
+      g_mutex_unlock (&victim->lock);
+    }
+
+  if (task)
+    (void) g_atomic_int_dec_and_test (&pool->n_queued);
+
+  return task;
+}
+
+static void
+pool_take_error (GsPool *pool,
+                 GError *error)
+{
+  g_mutex_lock (&pool->lock);
+  if (pool->error == NULL)
+    pool->error = error;
+  else
+    g_error_free (error);
+  g_mutex_unlock (&pool->lock);
+
+  g_atomic_int_set (&pool->failed, 1);
+}
+
+static gboolean
+pool_check_failed (GsPoolWorker  *worker,
+                   GError       **error)
+{
+  if (worker && g_atomic_int_get (&worker->pool->failed))
+    {
+      /* The real error is already recorded in the pool */
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_CANCELLED,
+                           "Operation was cancelled");
+      return TRUE;
+    }
+  return FALSE;
+}
+
+/* Called after each unit of work; passes the counts in @worker on to
+ * the progress every so often, or always with @force.
+ */
+static void
+pool_worker_flush_stats (GsPoolWorker *worker,
+                         gboolean      force)
+{
+  gint64 now;
+
+  if (worker == NULL || worker->pool->progress == NULL)
+    return;
+
+  now = g_get_monotonic_time ();
+  if (!force && now - worker->stats_flushed < GS_PROGRESS_FLUSH_USEC)
+    return;
+
+  worker->stats_flushed = now;
+  progress_merge (worker->pool->progress, &worker->stats, FALSE);
+}
+
+static gpointer
+pool_worker_thread (gpointer data)
+{
+  GsPoolWorker *worker = data;
+  GsPool *pool = worker->pool;
+
+  while (TRUE)
+    {
+      GsPoolTask *task = pool_pop (worker);
+      gboolean done;
+
+      if (task)
+        {
+          GError *local_error = NULL;
+
+          if (!g_atomic_int_get (&pool->failed) &&
+              !task->run (task, worker, pool->cancellable, &local_error))
+            pool_take_error (pool, local_error);
+          task->destroy (task);
+          pool_worker_flush_stats (worker, FALSE);
+
+          g_mutex_lock (&pool->lock);
+          if (--pool->n_pending == 0)
+            g_cond_broadcast (&pool->cond);
+          g_mutex_unlock (&pool->lock);
+          continue;
+        }
+
+      g_mutex_lock (&pool->lock);
+      while (g_atomic_int_get (&pool->n_queued) == 0 && pool->n_pending > 0)
+        g_cond_wait (&pool->cond, &pool->lock);
+      done = (pool->n_pending == 0);
+      g_mutex_unlock (&pool->lock);
+
+      if (done)
+        break;
+    }
+
+  pool_worker_flush_stats (worker, TRUE);
+  return NULL;
+}
+
+/* Run @root_task, and everything it queues, on @n_workers threads.
+ * The pool takes ownership of @root_task.
+ */
+static gboolean
+pool_run (GsPoolTask        *root_task,
+          const char        *thread_name,
+          guint              n_workers,
+          GSShutilProgress  *progress,
+          GCancellable      *cancellable,
+          GError           **error)
+{
+  GsPool pool = { 0, };
+  guint i;
+
+  pool.cancellable = cancellable;
+  pool.progress = progress;
+  pool.n_workers = n_workers;
+  pool.workers = g_new0 (GsPoolWorker, n_workers);
+  g_mutex_init (&pool.lock);
+  g_cond_init (&pool.cond);
+  for (i = 0; i < n_workers; i++)
+    {
+      pool.workers[i].pool = &pool;
+      pool.workers[i].index = i;
+      g_mutex_init (&pool.workers[i].lock);
+      g_queue_init (&pool.workers[i].tasks);
+    }
+
+  pool_push (&pool.workers[0], root_task);
+
+  for (i = 0; i < n_workers; i++)
+    pool.workers[i].thread = g_thread_new (thread_name, pool_worker_thread,
+                                           &pool.workers[i]);
+  for (i = 0; i < n_workers; i++)
+    g_thread_join (pool.workers[i].thread);
+
+  for (i = 0; i < n_workers; i++)
+    g_mutex_clear (&pool.workers[i].lock);
+  g_free (pool.workers);
+  g_mutex_clear (&pool.lock);
+  g_cond_clear (&pool.cond);
+
+  if (pool.error)
+    {
+      g_propagate_error (error, pool.error);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+typedef enum {
+  GS_CP_MODE_NONE,
+  GS_CP_MODE_HARDLINK,
+  GS_CP_MODE_COPY_ALL
+} GsCpMode;
+
+/* Regular files at least this large are handed to another worker by
+ * gs_shutil_cp_a_parallel(), rather than copied inline.
+ */
+#define GS_CP_PARALLEL_FILE_THRESHOLD (1024 * 1024)
+
+typedef struct {
+  dev_t dev;
+  ino_t ino;
+} GsCpInode;
+
+/* State shared by a whole tree copy */
+typedef struct {
+  GSShutilCpFlags flags;
+  int dest_root_dfd;
+  int store_dfd;  /* For gs_shutil_cp_al_dedup(), or -1 */
+  gboolean move;  /* For gs_shutil_mv_at(); delete each source once copied */
+
+  /* Source inodes with more than one link, mapped to the path
+   * (relative to @dest_root_dfd) of their first copy; later links
+   * are then hardlinked to that, as in the source.
+   */
+  GMutex links_lock;
+  GHashTable *links;
+} GsCpContext;
+
+static guint
+cp_inode_hash (gconstpointer v)
+{
+  const GsCpInode *inode = v;
+  guint64 ino = inode->ino;
+  return (guint) (ino ^ (ino >> 32)) ^ (guint) inode->dev;
+}
+
+static gboolean
+cp_inode_equal (gconstpointer v1,
+                gconstpointer v2)
+{
+  const GsCpInode *a = v1;
+  const GsCpInode *b = v2;
+  return a->dev == b->dev && a->ino == b->ino;
+}
+
+/* If another link to the inode @src_stbuf has already been copied,
+ * hardlink @name in @dest_dfd to that copy, and set @out_linked.
+ */
+static gboolean
+cp_context_link_known (GsCpContext        *ctx,
+                       const struct stat  *src_stbuf,
+                       int                 dest_dfd,
+                       const char         *name,
+                       gboolean           *out_linked,
+                       GError            **error)
+{
+  GsCpInode key = { src_stbuf->st_dev, src_stbuf->st_ino };
+  char *target;
+  int r;
+
+  *out_linked = FALSE;
+
+  g_mutex_lock (&ctx->links_lock);
+  target = g_strdup (g_hash_table_lookup (ctx->links, &key));
+  g_mutex_unlock (&ctx->links_lock);
+
+  if (target == NULL)
+    return TRUE;
+
+  r = linkat (ctx->dest_root_dfd, target, dest_dfd, name, 0);
+  g_free (target);
+  if (r == -1)
+    {
+      /* Too many links, or a filesystem without them; just copy */
+      if (errno == EMLINK || errno == EPERM || errno == EOPNOTSUPP ||
+          errno == ENOENT)
+        return TRUE;
+      gs_set_prefix_error_from_errno (error, errno, "linkat");
+      return FALSE;
+    }
+
+  *out_linked = TRUE;
+  return TRUE;
+}
+
+static void
+cp_context_remember (GsCpContext        *ctx,
+                     const struct stat  *src_stbuf,
+                     const char         *dest_dir_path,
+                     const char         *name)
+{
+  GsCpInode *key = g_new (GsCpInode, 1);
+
+  key->dev = src_stbuf->st_dev;
+  key->ino = src_stbuf->st_ino;
+
+  g_mutex_lock (&ctx->links_lock);
+  if (!g_hash_table_contains (ctx->links, key))
+    g_hash_table_insert (ctx->links, key,
+                         *dest_dir_path ? g_strconcat (dest_dir_path, "/", name, NULL)
+                                        : g_strdup (name));
+  else
+    g_free (key);
+  g_mutex_unlock (&ctx->links_lock);
+}
+
+typedef enum {
+  GS_CP_TASK_DIR,
+  GS_CP_TASK_FILE
+} GsCpTaskType;
+
+/* A unit of work for gs_shutil_cp_a_parallel().  The destination
+ * (directory or file) has already been created, and both sides are
+ * held open, so a task never needs to resolve a path.
+ */
+typedef struct {
+  GsPoolTask base;
+  GsCpTaskType type;
+  GsCpMode mode;
+  GsCpContext *ctx;
+  GSDirFdIterator src_iter;  /* GS_CP_TASK_DIR */
+  char *dest_path;           /* GS_CP_TASK_DIR */
+  int src_fd;                /* GS_CP_TASK_FILE */
+  struct stat src_stbuf;     /* GS_CP_TASK_FILE */
+  int dest_fd;
+} GsCpTask;
+
+static gboolean
+cp_task_run (GsPoolTask    *base,
+             GsPoolWorker  *worker,
+             GCancellable  *cancellable,
+             GError       **error);
+
+static void
+cp_task_free (GsCpTask *task)
+{
+  gs_dirfd_iterator_clear (&task->src_iter);
+  if (task->src_fd != -1)
+    (void) close (task->src_fd);
+  if (task->dest_fd != -1)
+    (void) close (task->dest_fd);
+  g_free (task->dest_path);
+  g_free (task);
+}
+
+static GsCpTask *
+cp_task_new (GsCpTaskType   type,
+             GsCpMode       mode,
+             GsCpContext   *ctx)
+{
+  GsCpTask *task = g_new0 (GsCpTask, 1);
+  task->base.run = cp_task_run;
+  task->base.destroy = (GDestroyNotify) cp_task_free;
+  task->type = type;
+  task->mode = mode;
+  task->ctx = ctx;
+  task->src_fd = -1;
+  task->dest_fd = -1;
+  return task;
+}
+
+static gboolean
+copy_regfile_fd (int                 src_fd,
+                 int                 dest_fd,
+                 const struct stat  *src_stbuf,
+                 gboolean            all_metadata,
+                 gboolean            writeback,
+                 GSShutilStats      *stats,
+                 GCancellable       *cancellable,
+                 GError            **error)
+{
+  gint64 start = stats ? g_get_monotonic_time () : 0;
+  int r;
+
+  if (!gs_fd_copy_data (src_fd, dest_fd, cancellable, error))
+    return FALSE;
+
+  if (stats)
+    {
+      stats->n_bytes += src_stbuf->st_size;
+      stats->data_usec += g_get_monotonic_time () - start;
+    }
+
+  if (all_metadata)
+    {
+      do
+        r = fchown (dest_fd, src_stbuf->st_uid, src_stbuf->st_gid);
+      while (G_UNLIKELY (r == -1 && errno == EINTR));
+    }
+
+  /* Done after fchown(), which may clear the setuid bits */
+  do
+    r = fchmod (dest_fd, src_stbuf->st_mode & 07777);
+  while (G_UNLIKELY (r == -1 && errno == EINTR));
+  if (r == -1)
+    {
+      gs_set_prefix_error_from_errno (error, errno, "fchmod");
+      return FALSE;
+    }
+
+  if (all_metadata)
+    {
+      struct timespec ts[2] = { src_stbuf->st_atim, src_stbuf->st_mtim };
+
+      (void) gs_fd_copy_all_xattrs (src_fd, dest_fd, cancellable, NULL);
+      (void) futimens (dest_fd, ts);
+    }
+
+  /* For GS_SHUTIL_CP_DURABLE; get the data moving now, so that the
+   * final syncfs() has little left to wait for.
+   */
+  if (writeback)
+    gs_fd_start_writeback (dest_fd);
+
+  return TRUE;
+}
+
+/* Copy the regular file @old_name into an anonymous file in
+ * @new_dir_fd, and only give it a name once it is complete, so an
+ * interrupted move never leaves a partial file under @new_name.
+ */
+static gboolean
+mv_regfile_at (int                 old_dir_fd,
+               const char         *old_name,
+               const struct stat  *stbuf,
+               int                 new_dir_fd,
+               const char         *new_name,
+               GSRenameFlags       flags,
+               GCancellable       *cancellable,
+               GError            **error)
+{
+  gboolean ret = FALSE;
+  int src_fd = -1;
+  int dest_fd = -1;
+  char *tmp_name = NULL;
+
+  if (!gs_file_openat_noatime (old_dir_fd, old_name, &src_fd, cancellable, error))
+    goto out;
+
+  if (!gs_file_open_anonymous_at (new_dir_fd, 0600, &dest_fd, &tmp_name,
+                                  cancellable, error))
+    goto out;
+
+  if (!copy_regfile_fd (src_fd, dest_fd, stbuf, TRUE, FALSE, NULL,
+                        cancellable, error))
+    goto out;
+
+  if (!gs_file_commit_anonymous_at (new_dir_fd, dest_fd, tmp_name, new_name,
+                                    flags & GS_RENAME_NOREPLACE,
+                                    cancellable, error))
+    goto out;
+  g_free (tmp_name);
+  tmp_name = NULL;
+
+  ret = TRUE;
+ out:
+  if (tmp_name)
+    (void) unlinkat (new_dir_fd, tmp_name, 0);
+  if (src_fd != -1)
+    (void) close (src_fd);
+  if (dest_fd != -1)
+    (void) close (dest_fd);
+  g_free (tmp_name);
+  return ret;
+}
+
+/* Copy the non-directory @name, described by @src_stbuf, from
+ * @src_dfd to @dest_name in @dest_dfd.  Like g_file_copy(), failing
+ * to copy metadata other than the permission bits is not a hard
+ * error.
+ */
+static gboolean
+copy_file_at (int                 src_dfd,
+              const char         *name,
+              const struct stat  *src_stbuf,
+              int                 dest_dfd,
+              const char         *dest_name,
+              GsCpMode            mode,
+              GsCpContext        *ctx,
+              GsPoolWorker       *worker,
+              GCancellable       *cancellable,
+              GError            **error)
 {
   gboolean ret = FALSE;
-  GVariant *src_xattrs = NULL;
+  gboolean all_metadata = (mode == GS_CP_MODE_COPY_ALL);
+  int src_fd = -1;
+  int dest_fd = -1;
+  int r;
+
+  if (S_ISLNK (src_stbuf->st_mode))
+    {
+      char target[PATH_MAX + 1];
+      ssize_t len;
+
+      len = _gs_readlinkat_buf (src_dfd, name, target, sizeof (target), error);
+      if (len == -1)
+        goto out;
+
+      if (symlinkat (target, dest_dfd, dest_name) == -1)
+        {
+          gs_set_prefix_error_from_errno (error, errno, "symlinkat");
+          goto out;
+        }
+
+      if (all_metadata)
+        {
+          struct timespec ts[2] = { src_stbuf->st_atim, src_stbuf->st_mtim };
+
+          (void) fchownat (dest_dfd, dest_name, src_stbuf->st_uid, src_stbuf->st_gid,
+                           AT_SYMLINK_NOFOLLOW);
+          (void) utimensat (dest_dfd, dest_name, ts, AT_SYMLINK_NOFOLLOW);
+        }
+    }
+  else if (S_ISREG (src_stbuf->st_mode) && ctx->move)
+    {
+      if (!mv_regfile_at (src_dfd, name, src_stbuf, dest_dfd, dest_name,
+                          GS_RENAME_NOREPLACE, cancellable, error))
+        goto out;
+    }
+  else if (S_ISREG (src_stbuf->st_mode))
+    {
+      if (!gs_file_openat_noatime (src_dfd, name, &src_fd, cancellable, error))
+        goto out;
+
+      do
+        dest_fd = openat (dest_dfd, dest_name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC | O_NOFOLLOW, 0600);
+      while (G_UNLIKELY (dest_fd == -1 && errno == EINTR));
+      if (dest_fd == -1)
+        {
+          gs_set_prefix_error_from_errno (error, errno, "openat");
+          goto out;
+        }
+
+      /* Files for the content store must be complete before they
+       * are linked there, so those are always copied inline.
+       */
+      if (worker && ctx->store_dfd == -1 &&
+          src_stbuf->st_size >= GS_CP_PARALLEL_FILE_THRESHOLD &&
+          pool_can_push (worker->pool))
+        {
+          GsCpTask *task = cp_task_new (GS_CP_TASK_FILE, mode, ctx);
+          task->src_fd = src_fd;
+          task->dest_fd = dest_fd;
+          task->src_stbuf = *src_stbuf;
+          src_fd = dest_fd = -1;
+          pool_push (worker, &task->base);
+        }
+      else
+        {
+          if (!copy_regfile_fd (src_fd, dest_fd, src_stbuf, all_metadata,
+                                (ctx->flags & GS_SHUTIL_CP_DURABLE) != 0,
+                                worker ? &worker->stats : NULL,
+                                cancellable, error))
+            goto out;
+
+          r = close (dest_fd);
+          dest_fd = -1;
+          if (r == -1)
+            {
+              gs_set_prefix_error_from_errno (error, errno, "close");
+              goto out;
+            }
+        }
+    }
+  else
+    {
+      do
+        r = mknodat (dest_dfd, dest_name, src_stbuf->st_mode, src_stbuf->st_rdev);
+      while (G_UNLIKELY (r == -1 && errno == EINTR));
+      if (r == -1)
+        {
+          gs_set_prefix_error_from_errno (error, errno, "mknodat");
+          goto out;
+        }
+
+      if (all_metadata)
+        (void) fchownat (dest_dfd, dest_name, src_stbuf->st_uid, src_stbuf->st_gid,
+                         AT_SYMLINK_NOFOLLOW);
+
+      /* mknodat() applies the umask; as for regular files, done after
+       * fchownat(), which may clear the setuid bits.
+       */
+      do
+        r = fchmodat (dest_dfd, dest_name, src_stbuf->st_mode & 07777, 0);
+      while (G_UNLIKELY (r == -1 && errno == EINTR));
+      if (r == -1)
+        {
+          gs_set_prefix_error_from_errno (error, errno, "fchmodat");
+          goto out;
+        }
+
+      if (all_metadata)
+        {
+          struct timespec ts[2] = { src_stbuf->st_atim, src_stbuf->st_mtim };
+
+          (void) utimensat (dest_dfd, dest_name, ts, AT_SYMLINK_NOFOLLOW);
+        }
+    }
+
+  ret = TRUE;
+ out:
+  if (src_fd != -1)
+    (void) close (src_fd);
+  if (dest_fd != -1)
+    (void) close (dest_fd);
+  return ret;
+}
+
+#define GS_CP_READ_BUFSIZE (64 * 1024)
+
+static gboolean
+read_fully (int            fd,
+            guint8        *buf,
+            gsize          len,
+            gsize         *out_bytes_read,
+            GError       **error)
+{
+  gsize total = 0;
+
+  while (total < len)
+    {
+      ssize_t n;
+
+      do
+        n = read (fd, buf + total, len - total);
+      while (G_UNLIKELY (n == -1 && errno == EINTR));
+      if (n == -1)
+        {
+          gs_set_prefix_error_from_errno (error, errno, "read");
+          return FALSE;
+        }
+      if (n == 0)
+        break;
+      total += n;
+    }
+
+  *out_bytes_read = total;
+  return TRUE;
+}
+
+/* Feed the rest of @fd into @checksum; with @stats, count the bytes
+ * and time taken there.
+ */
+static gboolean
+checksum_update_from_fd (GChecksum      *checksum,
+                         int             fd,
+                         GSShutilStats  *stats,
+                         GCancellable   *cancellable,
+                         GError        **error)
+{
+  gboolean ret = FALSE;
+  guint8 *buf = g_malloc (GS_CP_READ_BUFSIZE);
+  gint64 start = stats ? g_get_monotonic_time () : 0;
+
+  while (TRUE)
+    {
+      gsize len;
+
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        goto out;
+
+      if (!read_fully (fd, buf, GS_CP_READ_BUFSIZE, &len, error))
+        goto out;
+      if (len == 0)
+        break;
+
+      g_checksum_update (checksum, buf, len);
+      if (stats)
+        stats->n_bytes += len;
+    }
+
+  ret = TRUE;
+ out:
+  if (stats)
+    stats->data_usec += g_get_monotonic_time () - start;
+  g_free (buf);
+  return ret;
+}
+
+/* Compare the contents of the regular files @name in @src_dfd and
+ * @dest_dfd; the caller has already checked that the sizes match.
+ */
+static gboolean
+cp_sync_contents_equal (int            src_dfd,
+                        int            dest_dfd,
+                        const char    *name,
+                        gboolean      *out_equal,
+                        GCancellable  *cancellable,
+                        GError       **error)
+{
+  gboolean ret = FALSE;
+  gboolean equal = TRUE;
+  int src_fd = -1;
+  int dest_fd = -1;
+  guint8 *src_buf = NULL;
+  guint8 *dest_buf = NULL;
+
+  if (!gs_file_openat_noatime (src_dfd, name, &src_fd, cancellable, error))
+    goto out;
+  if (!gs_file_openat_noatime (dest_dfd, name, &dest_fd, cancellable, error))
+    goto out;
+
+  src_buf = g_malloc (GS_CP_READ_BUFSIZE);
+  dest_buf = g_malloc (GS_CP_READ_BUFSIZE);
+
+  while (equal)
+    {
+      gsize src_len, dest_len;
+
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        goto out;
+
+      if (!read_fully (src_fd, src_buf, GS_CP_READ_BUFSIZE, &src_len, error))
+        goto out;
+      if (!read_fully (dest_fd, dest_buf, GS_CP_READ_BUFSIZE, &dest_len, error))
+        goto out;
+
+      if (src_len != dest_len || memcmp (src_buf, dest_buf, src_len) != 0)
+        equal = FALSE;
+      else if (src_len == 0)
+        break;
+    }
+
+  ret = TRUE;
+  *out_equal = equal;
+ out:
+  g_free (src_buf);
+  g_free (dest_buf);
+  if (src_fd != -1)
+    (void) close (src_fd);
+  if (dest_fd != -1)
+    (void) close (dest_fd);
+  return ret;
+}
+
+/* How cp_entries_equal() compares regular files, besides their size */
+typedef enum {
+  GS_CP_COMPARE_MTIME = (1 << 0),
+  GS_CP_COMPARE_CONTENTS = (1 << 1)
+} GsCpCompareFlags;
+
+/* Check whether the non-directories @name in @src_dfd and @dest_dfd,
+ * described by @src_stbuf and @dest_stbuf, are the same: the same
+ * inode, or the same type and permissions, and then the same target,
+ * device number, or regular file as per @compare.  Ownership is not
+ * compared.
+ */
+static gboolean
+cp_entries_equal (int                 src_dfd,
+                  const struct stat  *src_stbuf,
+                  int                 dest_dfd,
+                  const struct stat  *dest_stbuf,
+                  const char         *name,
+                  GsCpCompareFlags    compare,
+                  gboolean           *out_equal,
+                  GCancellable       *cancellable,
+                  GError            **error)
+{
+  gboolean equal = FALSE;
+
+  if (src_stbuf->st_dev == dest_stbuf->st_dev &&
+      src_stbuf->st_ino == dest_stbuf->st_ino)
+    {
+      /* Already hardlinked */
+      equal = TRUE;
+    }
+  else if ((src_stbuf->st_mode & (S_IFMT | 07777)) !=
+           (dest_stbuf->st_mode & (S_IFMT | 07777)))
+    ;
+  else if (S_ISLNK (src_stbuf->st_mode))
+    {
+      char src_target[PATH_MAX + 1];
+      char dest_target[PATH_MAX + 1];
+      ssize_t src_len, dest_len;
+
+      src_len = _gs_readlinkat_buf (src_dfd, name, src_target,
+                                    sizeof (src_target), error);
+      if (src_len == -1)
+        return FALSE;
+      dest_len = _gs_readlinkat_buf (dest_dfd, name, dest_target,
+                                     sizeof (dest_target), error);
+      if (dest_len == -1)
+        return FALSE;
+
+      equal = (src_len == dest_len &&
+               memcmp (src_target, dest_target, src_len) == 0);
+    }
+  else if (S_ISREG (src_stbuf->st_mode))
+    {
+      equal = (src_stbuf->st_size == dest_stbuf->st_size);
+
+      if (equal && (compare & GS_CP_COMPARE_MTIME) != 0)
+        equal = (src_stbuf->st_mtim.tv_sec == dest_stbuf->st_mtim.tv_sec &&
+                 src_stbuf->st_mtim.tv_nsec == dest_stbuf->st_mtim.tv_nsec);
+
+      if (equal && (compare & GS_CP_COMPARE_CONTENTS) != 0)
+        {
+          if (!cp_sync_contents_equal (src_dfd, dest_dfd, name, &equal,
+                                       cancellable, error))
+            return FALSE;
+        }
+    }
+  else
+    equal = (src_stbuf->st_rdev == dest_stbuf->st_rdev);
+
+  *out_equal = equal;
+  return TRUE;
+}
+
+/* For %GS_SHUTIL_CP_SYNC; check whether the existing destination for
+ * the non-directory @name, described by @src_stbuf, is already up to
+ * date.  If it is not, it is deleted, so that it can be copied anew.
+ */
+static gboolean
+cp_sync_check_dest (int                 src_dfd,
+                    const char         *name,
+                    const struct stat  *src_stbuf,
+                    int                 dest_dfd,
+                    GSShutilCpFlags     flags,
+                    gboolean           *out_up_to_date,
+                    GCancellable       *cancellable,
+                    GError            **error)
+{
+  struct stat dest_stbuf;
+  gboolean up_to_date = FALSE;
+  GsCpCompareFlags compare = GS_CP_COMPARE_MTIME;
+
+  if (fstatat (dest_dfd, name, &dest_stbuf, AT_SYMLINK_NOFOLLOW) == -1)
+    {
+      if (errno != ENOENT)
+        {
+          gs_set_prefix_error_from_errno (error, errno, "fstatat");
+          return FALSE;
+        }
+      *out_up_to_date = FALSE;
+      return TRUE;
+    }
+
+  if ((flags & GS_SHUTIL_CP_SYNC_CHECKSUM) != 0)
+    compare |= GS_CP_COMPARE_CONTENTS;
+  if (!cp_entries_equal (src_dfd, src_stbuf, dest_dfd, &dest_stbuf, name,
+                         compare, &up_to_date, cancellable, error))
+    return FALSE;
+
+  if (!up_to_date)
+    {
+      if (S_ISDIR (dest_stbuf.st_mode))
+        {
+          if (!gs_shutil_rm_rf_at (dest_dfd, name, cancellable, error))
+            return FALSE;
+        }
+      else if (unlinkat (dest_dfd, name, 0) == -1 && errno != ENOENT)
+        {
+          gs_set_prefix_error_from_errno (error, errno, "unlinkat");
+          return FALSE;
+        }
+    }
+
+  *out_up_to_date = up_to_date;
+  return TRUE;
+}
+
+/* For %GS_SHUTIL_CP_SYNC; delete everything in @dest_dfd that has no
+ * counterpart in @src_dfd.
+ */
+static gboolean
+cp_sync_prune_dest (int            src_dfd,
+                    int            dest_dfd,
+                    GsPoolWorker  *worker,
+                    GCancellable  *cancellable,
+                    GError       **error)
+{
+  gboolean ret = FALSE;
+  GSDirFdIterator dest_iter = { 0, };
+
+  if (!gs_dirfd_iterator_init_at (dest_dfd, ".", FALSE, &dest_iter, error))
+    goto out;
+
+  while (TRUE)
+    {
+      struct dirent *dent;
+      struct stat stbuf;
+
+      if (!gs_dirfd_iterator_next_dent (&dest_iter, &dent, cancellable, error))
+        goto out;
+      if (!dent)
+        break;
+
+      if (fstatat (src_dfd, dent->d_name, &stbuf, AT_SYMLINK_NOFOLLOW) == 0)
+        continue;
+      if (errno != ENOENT)
+        {
+          gs_set_prefix_error_from_errno (error, errno, "fstatat");
+          goto out;
+        }
+
+      if (!gs_shutil_rm_rf_at (dest_iter.fd, dent->d_name, cancellable, error))
+        goto out;
+      if (worker)
+        worker->stats.n_deleted++;
+    }
+
+  ret = TRUE;
+ out:
+  gs_dirfd_iterator_clear (&dest_iter);
+  return ret;
+}
+
+/* For gs_shutil_cp_al_dedup(); compute the name in the content store
+ * of the regular file @name.  It covers the contents, and the
+ * metadata that all hardlinks to a file necessarily share: owner,
+ * permissions, modification time and extended attributes.
+ */
+static gboolean
+cp_dedup_object_name (int                 src_dfd,
+                      const char         *name,
+                      const struct stat  *src_stbuf,
+                      char              **out_object_name,
+                      GCancellable       *cancellable,
+                      GError            **error)
+{
+  gboolean ret = FALSE;
+  GChecksum *checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  GChecksum *xattrs_checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  GVariant *xattrs = NULL;
+  int fd = -1;
+
+  if (!gs_file_openat_noatime (src_dfd, name, &fd, cancellable, error))
+    goto out;
+
+  if (!checksum_update_from_fd (checksum, fd, NULL, cancellable, error))
+    goto out;
+
+  /* Already in a canonical order */
+  if (!gs_fd_get_all_xattrs (fd, &xattrs, cancellable, error))
+    goto out;
+  g_checksum_update (xattrs_checksum, g_variant_get_data (xattrs), g_variant_get_size (xattrs));
+
+  ret = TRUE;
+  *out_object_name = g_strdup_printf ("%s.%s.%u.%u.%o.%" G_GINT64_FORMAT ".%09ld",
+                                      g_checksum_get_string (checksum),
+                                      g_checksum_get_string (xattrs_checksum),
+                                      (guint) src_stbuf->st_uid, (guint) src_stbuf->st_gid,
+                                      (guint) (src_stbuf->st_mode & 07777),
+                                      (gint64) src_stbuf->st_mtim.tv_sec,
+                                      (long) src_stbuf->st_mtim.tv_nsec);
+ out:
+  g_checksum_free (checksum);
+  g_checksum_free (xattrs_checksum);
+  if (xattrs)
+    g_variant_unref (xattrs);
+  if (fd != -1)
+    (void) close (fd);
+  return ret;
+}
+
+/* Copy the regular file @name via the content store of @ctx: if the
+ * store already has an identical file, just hardlink to it, and
+ * otherwise copy the file and add it to the store.
+ */
+static gboolean
+cp_dedup_file_at (GsCpContext        *ctx,
+                  int                 src_dfd,
+                  const char         *name,
+                  const struct stat  *src_stbuf,
+                  int                 dest_dfd,
+                  GsCpMode            mode,
+                  GsPoolWorker       *worker,
+                  gboolean           *out_linked,
+                  GCancellable       *cancellable,
+                  GError            **error)
+{
+  gboolean ret = FALSE;
+  char *object_name = NULL;
+
+  *out_linked = FALSE;
+
+  if (!cp_dedup_object_name (src_dfd, name, src_stbuf, &object_name,
+                             cancellable, error))
+    goto out;
+
+  if (linkat (ctx->store_dfd, object_name, dest_dfd, name, 0) == 0)
+    {
+      ret = TRUE;
+      *out_linked = TRUE;
+      goto out;
+    }
+  if (!(errno == ENOENT || errno == EMLINK || errno == EXDEV))
+    {
+      gs_set_prefix_error_from_errno (error, errno, "linkat");
+      goto out;
+    }
+
+  if (!copy_file_at (src_dfd, name, src_stbuf, dest_dfd, name, mode, ctx, worker,
+                     cancellable, error))
+    goto out;
+
+  /* Losing a race with another thread is fine, as is a full object */
+  if (linkat (dest_dfd, name, ctx->store_dfd, object_name, 0) == -1 &&
+      !(errno == EEXIST || errno == EMLINK || errno == EXDEV))
+    {
+      gs_set_prefix_error_from_errno (error, errno, "linkat");
+      goto out;
+    }
+
+  ret = TRUE;
+ out:
+  g_free (object_name);
+  return ret;
+}
+
+/* Create the directory @dest_name in @dest_parent_dfd as a copy of
+ * the directory open as @src_dfd (without its contents), and return
+ * a file descriptor for it in @out_dest_dfd.  With
+ * %GS_SHUTIL_CP_SYNC, an existing directory is reused.
+ */
+static gboolean
+cp_make_dest_dir (int              src_dfd,
+                  int              dest_parent_dfd,
+                  const char      *dest_name,
+                  GsCpMode         mode,
+                  GSShutilCpFlags  flags,
+                  int             *out_dest_dfd,
+                  GCancellable    *cancellable,
+                  GError         **error)
+{
+  gboolean ret = FALSE;
+  struct stat src_stbuf;
+  int dest_dfd = -1;
+  int r;
+
+  if (fstat (src_dfd, &src_stbuf) == -1)
+    {
+      gs_set_prefix_error_from_errno (error, errno, "fstat");
+      goto out;
+    }
+
+  do
+    r = mkdirat (dest_parent_dfd, dest_name, 0755);
+  while (G_UNLIKELY (r == -1 && errno == EINTR));
+  if (r == -1 && errno == EEXIST && (flags & GS_SHUTIL_CP_SYNC) != 0)
+    {
+      struct stat dest_stbuf;
+
+      if (fstatat (dest_parent_dfd, dest_name, &dest_stbuf, AT_SYMLINK_NOFOLLOW) == -1)
+        {
+          gs_set_prefix_error_from_errno (error, errno, "fstatat");
+          goto out;
+        }
+
+      if (S_ISDIR (dest_stbuf.st_mode))
+        r = 0;
+      else if (unlinkat (dest_parent_dfd, dest_name, 0) == -1)
+        {
+          gs_set_prefix_error_from_errno (error, errno, "unlinkat");
+          goto out;
+        }
+      else
+        {
+          do
+            r = mkdirat (dest_parent_dfd, dest_name, 0755);
+          while (G_UNLIKELY (r == -1 && errno == EINTR));
+        }
+    }
+  if (r == -1)
+    {
+      gs_set_prefix_error_from_errno (error, errno, "mkdirat");
+      goto out;
+    }
+
+  if (!gs_opendirat (dest_parent_dfd, dest_name, FALSE, &dest_dfd, error))
+    goto out;
+
+  if (mode != GS_CP_MODE_NONE)
+    {
+      do
+        r = fchown (dest_dfd, src_stbuf.st_uid, src_stbuf.st_gid);
+      while (G_UNLIKELY (r == -1 && errno == EINTR));
+      if (r == -1)
+        {
+          gs_set_prefix_error_from_errno (error, errno, "fchown");
+          goto out;
+        }
+
+      do
+        r = fchmod (dest_dfd, src_stbuf.st_mode & 07777);
+      while (G_UNLIKELY (r == -1 && errno == EINTR));
+
+      (void) gs_fd_copy_all_xattrs (src_dfd, dest_dfd, cancellable, NULL);
+    }
+
+  ret = TRUE;
+  *out_dest_dfd = dest_dfd;
+  dest_dfd = -1;
+ out:
+  if (dest_dfd != -1)
+    (void) close (dest_dfd);
+  return ret;
+}
+
+static gboolean
+cp_populate_dir (GSDirFdIterator  *src_iter,
+                 int               dest_dfd,
+                 const char       *dest_path,
+                 GsCpMode          mode,
+                 GsCpContext      *ctx,
+                 GsPoolWorker     *worker,
+                 GCancellable     *cancellable,
+                 GError          **error);
+
+static gboolean
+cp_walk (int               src_dfd,
+         int               dest_dfd,
+         const char       *dest_path,
+         GsCpMode          mode,
+         GsCpContext      *ctx,
+         GsPoolWorker     *worker,
+         GCancellable     *cancellable,
+         GError          **error);
+
+static gboolean
+cp_child_at (int               src_dfd,
+             const char       *name,
+             unsigned char     d_type,
+             int               dest_dfd,
+             const char       *dest_path,
+             GsCpMode         *mode,
+             GsCpContext      *ctx,
+             GsPoolWorker     *worker,
+             GCancellable     *cancellable,
+             GError          **error)
+{
+  gboolean ret = FALSE;
+  gboolean have_stbuf = FALSE;
+  gboolean known = FALSE;
+  gboolean linked = FALSE;
+  struct stat stbuf;
+
+  if (d_type == DT_UNKNOWN)
+    {
+      if (fstatat (src_dfd, name, &stbuf, AT_SYMLINK_NOFOLLOW) == -1)
+        {
+          gs_set_prefix_error_from_errno (error, errno, "fstatat");
+          goto out;
+        }
+      have_stbuf = TRUE;
+      d_type = IFTODT (stbuf.st_mode);
+    }
+
+  if (d_type == DT_DIR)
+    {
+      GsCpTask *task = cp_task_new (GS_CP_TASK_DIR, *mode, ctx);
+
+      task->dest_path = *dest_path ? g_strconcat (dest_path, "/", name, NULL)
+                                   : g_strdup (name);
+
+      if (!gs_dirfd_iterator_init_at (src_dfd, name, FALSE, &task->src_iter, error) ||
+          !cp_make_dest_dir (task->src_iter.fd, dest_dfd, name, *mode, ctx->flags,
+                             &task->dest_fd, cancellable, error))
+        {
+          cp_task_free (task);
+          goto out;
+        }
+      if (worker)
+        worker->stats.n_directories++;
+
+      if (worker && pool_can_push (worker->pool))
+        pool_push (worker, &task->base);
+      else
+        {
+          gboolean child_ok;
+
+          if (worker && worker->inline_depth < GS_POOL_MAX_INLINE_DEPTH)
+            {
+              worker->inline_depth++;
+              child_ok = cp_populate_dir (&task->src_iter, task->dest_fd,
+                                          task->dest_path, *mode, ctx,
+                                          worker, cancellable, error);
+              worker->inline_depth--;
+            }
+          else
+            child_ok = cp_walk (task->src_iter.fd, task->dest_fd, task->dest_path,
+                                *mode, ctx, worker, cancellable, error);
+          cp_task_free (task);
+          if (!child_ok)
+            goto out;
+        }
+    }
+  else
+    {
+      if ((ctx->flags & GS_SHUTIL_CP_SYNC) != 0)
+        {
+          gboolean up_to_date;
+
+          if (!have_stbuf &&
+              fstatat (src_dfd, name, &stbuf, AT_SYMLINK_NOFOLLOW) == -1)
+            {
+              gs_set_prefix_error_from_errno (error, errno, "fstatat");
+              goto out;
+            }
+          have_stbuf = TRUE;
+
+          if (!cp_sync_check_dest (src_dfd, name, &stbuf, dest_dfd, ctx->flags,
+                                   &up_to_date, cancellable, error))
+            goto out;
+          if (up_to_date)
+            {
+              if (stbuf.st_nlink > 1)
+                cp_context_remember (ctx, &stbuf, dest_path, name);
+              if (worker)
+                {
+                  worker->stats.n_files++;
+                  worker->stats.n_skipped++;
+                }
+              ret = TRUE;
+              goto out;
+            }
+        }
+
+      if (*mode == GS_CP_MODE_HARDLINK)
+        {
+          if (linkat (src_dfd, name, dest_dfd, name, 0) == 0)
+            {
+              if (worker)
+                {
+                  worker->stats.n_files++;
+                  worker->stats.n_hardlinked++;
+                }
+              ret = TRUE;
+              goto out;
+            }
+          if (!(errno == EMLINK || errno == EXDEV || errno == EPERM))
+            {
+              gs_set_prefix_error_from_errno (error, errno, "linkat");
+              goto out;
+            }
+          /* We failed to hardlink; fall back to copying all; this will
+           * affect subsequent directory copies too.
+           */
+          *mode = GS_CP_MODE_COPY_ALL;
+        }
+
+      if (!have_stbuf &&
+          fstatat (src_dfd, name, &stbuf, AT_SYMLINK_NOFOLLOW) == -1)
+        {
+          gs_set_prefix_error_from_errno (error, errno, "fstatat");
+          goto out;
+        }
+
+      /* When moving, the links already moved no longer count */
+      if ((stbuf.st_nlink > 1 || ctx->move) &&
+          !cp_context_link_known (ctx, &stbuf, dest_dfd, name, &known, error))
+        goto out;
+
+      if (known)
+        linked = TRUE;
+      else if (ctx->store_dfd != -1 && S_ISREG (stbuf.st_mode))
+        {
+          if (!cp_dedup_file_at (ctx, src_dfd, name, &stbuf, dest_dfd, *mode,
+                                 worker, &linked, cancellable, error))
+            goto out;
+        }
+      else if (!copy_file_at (src_dfd, name, &stbuf, dest_dfd, name, *mode, ctx,
+                              worker, cancellable, error))
+        goto out;
+
+      if (!known && stbuf.st_nlink > 1)
+        cp_context_remember (ctx, &stbuf, dest_path, name);
+
+      if (worker)
+        {
+          worker->stats.n_files++;
+          if (linked)
+            worker->stats.n_hardlinked++;
+          else
+            worker->stats.n_copied++;
+        }
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/* Copy the contents of the directory open in @src_iter into the
+ * directory @dest_dfd.  Every entry is addressed relative to open
+ * directory file descriptors, so no path is resolved more than one
+ * component deep.  If @worker is given, subdirectories and large
+ * files may be queued for other threads rather than copied inline.
+ * With %GS_SHUTIL_CP_SYNC, entries of @dest_dfd missing from the
+ * source are deleted afterwards.
+ */
+static gboolean
+cp_populate_dir (GSDirFdIterator  *src_iter,
+                 int               dest_dfd,
+                 const char       *dest_path,
+                 GsCpMode          mode,
+                 GsCpContext      *ctx,
+                 GsPoolWorker     *worker,
+                 GCancellable     *cancellable,
+                 GError          **error)
+{
+  while (TRUE)
+    {
+      struct dirent *dent;
+
+      if (pool_check_failed (worker, error))
+        return FALSE;
+
+      if (!gs_dirfd_iterator_next_dent (src_iter, &dent, cancellable, error))
+        return FALSE;
+      if (!dent)
+        break;
+
+      if (!cp_child_at (src_iter->fd, dent->d_name, dent->d_type, dest_dfd,
+                        dest_path, &mode, ctx, worker, cancellable, error))
+        return FALSE;
+
+      pool_worker_flush_stats (worker, FALSE);
+    }
+
+  if ((ctx->flags & GS_SHUTIL_CP_SYNC) != 0 &&
+      !cp_sync_prune_dest (src_iter->fd, dest_dfd, worker, cancellable, error))
+    return FALSE;
+
+  return TRUE;
+}
+
+/* State of a cp_walk() */
+typedef struct {
+  GsCpContext *ctx;
+  GArray *modes;           /* GsCpMode of each directory being copied */
+  GsPoolWorker *worker;
+  GCancellable *cancellable;
+  int base_dfd;            /* Destination of the root of the walk */
+  const char *base_path;   /* Its path relative to ctx->dest_root_dfd */
+  int dest_dfd;            /* Destination directory for @dest_dir */
+  GString *dest_dir;       /* Path relative to the root of the walk */
+  GArray *dest_ids;        /* GsCpInode of each component of @dest_dir; 0 if unknown */
+  GString *dest_path;
+} GsCpWalk;
+
+/* The mode for the directory currently being copied.  A fallback from
+ * hardlinking to copying applies to the rest of that directory and
+ * its later subdirectories, as with cp_populate_dir().
+ */
+static GsCpMode *
+cp_walk_mode (GsCpWalk *walk)
+{
+  return &g_array_index (walk->modes, GsCpMode, walk->modes->len - 1);
+}
+
+static void
+cp_walk_set_dest_dfd (GsCpWalk *walk,
+                      int       dfd)
+{
+  if (walk->dest_dfd != walk->base_dfd)
+    (void) close (walk->dest_dfd);
+  walk->dest_dfd = dfd;
+}
+
+/* Remember the identity of @dfd, the destination directory for a new
+ * last component of @dest_dir, to check it when it is reopened.
+ */
+static gboolean
+cp_walk_push_dest_id (GsCpWalk  *walk,
+                      int        dfd,
+                      GError   **error)
+{
+  struct stat stbuf;
+  GsCpInode id;
+
+  if (fstat (dfd, &stbuf) == -1)
+    {
+      gs_set_prefix_error_from_errno (error, errno, "fstat");
+      return FALSE;
+    }
+  id.dev = stbuf.st_dev;
+  id.ino = stbuf.st_ino;
+  g_array_append_val (walk->dest_ids, id);
+  return TRUE;
+}
+
+/* Get the destination directory for the first @path_len bytes of
+ * @path, which is usually the one last used, or after a subdirectory
+ * is done, one of its ancestors; those are reached with "..", so
+ * that no path is resolved however deep the tree is.
+ */
+static gboolean
+cp_walk_get_dest_dir (GsCpWalk    *walk,
+                      const char  *path,
+                      gsize        path_len,
+                      int         *out_dfd,
+                      GError     **error)
+{
+  GString *dest_dir = walk->dest_dir;
+
+  while (!(dest_dir->len == path_len && memcmp (dest_dir->str, path, path_len) == 0))
+    {
+      const char *slash;
+      int dfd;
+
+      if (dest_dir->len < path_len ||
+          memcmp (dest_dir->str, path, path_len) != 0 ||
+          (path_len > 0 && dest_dir->str[path_len] != '/'))
+        {
+          /* Not an ancestor; should not happen, but is easy to handle */
+          char *rel_path = g_strndup (path, path_len);
+          gboolean opened;
+
+          dfd = walk->base_dfd;
+          opened = (path_len == 0 ||
+                    gs_opendirat (walk->base_dfd, rel_path, FALSE, &dfd, error));
+          g_free (rel_path);
+          if (!opened)
+            return FALSE;
+          cp_walk_set_dest_dfd (walk, dfd);
+          g_string_truncate (dest_dir, 0);
+          g_string_append_len (dest_dir, path, path_len);
+
+          /* Only the last component is known now */
+          g_array_set_size (walk->dest_ids, 0);
+          if (path_len > 0)
+            {
+              const char *p;
+
+              for (p = memchr (path, '/', path_len); p != NULL;
+                   p = memchr (p + 1, '/', path_len - (p + 1 - path)))
+                {
+                  GsCpInode unknown = { 0, 0 };
+                  g_array_append_val (walk->dest_ids, unknown);
+                }
+              if (!cp_walk_push_dest_id (walk, dfd, error))
+                return FALSE;
+            }
+          break;
+        }
+
+      slash = strrchr (dest_dir->str, '/');
+      if (slash == NULL)
+        dfd = walk->base_dfd;
+      else
+        {
+          const GsCpInode *expected =
+            &g_array_index (walk->dest_ids, GsCpInode, walk->dest_ids->len - 2);
+          struct stat stbuf;
+
+          do
+            dfd = openat (walk->dest_dfd, "..", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+          while (G_UNLIKELY (dfd == -1 && errno == EINTR));
+          if (dfd == -1)
+            {
+              gs_set_prefix_error_from_errno (error, errno, "openat");
+              return FALSE;
+            }
+          if (fstat (dfd, &stbuf) == -1)
+            {
+              gs_set_prefix_error_from_errno (error, errno, "fstat");
+              (void) close (dfd);
+              return FALSE;
+            }
+          if (expected->ino != 0 &&
+              (stbuf.st_dev != expected->dev || stbuf.st_ino != expected->ino))
+            {
+              g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                                   "Directory moved during copy");
+              (void) close (dfd);
+              return FALSE;
+            }
+        }
+      cp_walk_set_dest_dfd (walk, dfd);
+      g_string_truncate (dest_dir, slash ? (gsize) (slash - dest_dir->str) : 0);
+      g_array_set_size (walk->dest_ids, walk->dest_ids->len - 1);
+    }
+
+  *out_dfd = walk->dest_dfd;
+  return TRUE;
+}
+
+static gboolean
+cp_walk_pre (GSTreeWalker             *walker,
+             const GSTreeWalkerEntry  *entry,
+             gpointer                  user_data,
+             GError                  **error)
+{
+  GsCpWalk *walk = user_data;
+  gsize parent_len;
+  int dest_parent_dfd;
+
+  /* Created by the caller */
+  if (entry->depth == 0)
+    return TRUE;
+
+  if (pool_check_failed (walk->worker, error))
+    return FALSE;
+
+  parent_len = entry->depth > 1 ? strlen (entry->path) - strlen (entry->name) - 1 : 0;
+  if (!cp_walk_get_dest_dir (walk, entry->path, parent_len, &dest_parent_dfd, error))
+    return FALSE;
+
+  if (entry->type == DT_DIR)
+    {
+      int src_dfd = -1;
+      int dest_dfd = -1;
+      gboolean made;
+      GsCpMode dir_mode;
+
+      if (!gs_opendirat (entry->dfd, entry->name, FALSE, &src_dfd, error))
+        return FALSE;
+      made = cp_make_dest_dir (src_dfd, dest_parent_dfd, entry->name, *cp_walk_mode (walk),
+                               walk->ctx->flags, &dest_dfd, walk->cancellable, error);
+      (void) close (src_dfd);
+      if (!made)
+        return FALSE;
+
+      /* Popped again in cp_walk_post() */
+      dir_mode = *cp_walk_mode (walk);
+      g_array_append_val (walk->modes, dir_mode);
+
+      /* Its entries come next */
+      cp_walk_set_dest_dfd (walk, dest_dfd);
+      g_string_assign (walk->dest_dir, entry->path);
+      if (!cp_walk_push_dest_id (walk, dest_dfd, error))
+        return FALSE;
+      if (walk->worker)
+        walk->worker->stats.n_directories++;
+    }
+  else
+    {
+      g_string_assign (walk->dest_path, walk->base_path);
+      if (parent_len > 0)
+        {
+          if (walk->dest_path->len > 0)
+            g_string_append_c (walk->dest_path, '/');
+          g_string_append_len (walk->dest_path, entry->path, parent_len);
+        }
+
+      if (!cp_child_at (entry->dfd, entry->name, entry->type, dest_parent_dfd,
+                        walk->dest_path->str, cp_walk_mode (walk), walk->ctx, walk->worker,
+                        walk->cancellable, error))
+        return FALSE;
+
+      /* Without a worker, the copy is complete by now */
+      if (walk->ctx->move && unlinkat (entry->dfd, entry->name, 0) == -1)
+        {
+          gs_set_prefix_error_from_errno (error, errno, "unlinkat");
+          return FALSE;
+        }
+    }
+
+  pool_worker_flush_stats (walk->worker, FALSE);
+  return TRUE;
+}
+
+static gboolean
+cp_walk_post (GSTreeWalker             *walker,
+              const GSTreeWalkerEntry  *entry,
+              gpointer                  user_data,
+              GError                  **error)
+{
+  GsCpWalk *walk = user_data;
+  gboolean sync = (walk->ctx->flags & GS_SHUTIL_CP_SYNC) != 0;
+  gboolean move = walk->ctx->move;
+  int src_dfd = -1;
+  int dest_dfd;
+  gboolean ret = FALSE;
+
+  if (entry->depth > 0)
+    g_array_set_size (walk->modes, walk->modes->len - 1);
+
+  if (!sync && !move)
+    return TRUE;
+
+  if (!cp_walk_get_dest_dir (walk, entry->path, strlen (entry->path), &dest_dfd, error))
+    goto out;
+
+  if (sync)
+    {
+      if (!gs_opendirat (entry->dfd, entry->name, FALSE, &src_dfd, error))
+        goto out;
+      if (!cp_sync_prune_dest (src_dfd, dest_dfd, walk->worker, walk->cancellable, error))
+        goto out;
+    }
+
+  /* When moving, the source directory is empty by now.  Its times
+   * were taken as it was listed, and are only copied here, since
+   * filling in the destination changed them.  The caller removes the
+   * root.
+   */
+  if (move)
+    {
+      struct timespec ts[2];
+
+      ts[0].tv_sec = entry->stat->atime.sec;
+      ts[0].tv_nsec = entry->stat->atime.nsec;
+      ts[1].tv_sec = entry->stat->mtime.sec;
+      ts[1].tv_nsec = entry->stat->mtime.nsec;
+      (void) futimens (dest_dfd, ts);
+
+      if (entry->depth > 0 && unlinkat (entry->dfd, entry->name, AT_REMOVEDIR) == -1)
+        {
+          gs_set_prefix_error_from_errno (error, errno, "unlinkat");
+          goto out;
+        }
+    }
+
+  ret = TRUE;
+ out:
+  if (src_dfd != -1)
+    (void) close (src_dfd);
+  return ret;
+}
+
+/* Like cp_populate_dir(), but for trees of any depth: the directory
+ * @src_dfd is walked iteratively, and everything below it is copied
+ * inline, into the existing directory @dest_dfd.  If @ctx is for a
+ * move, everything below @src_dfd is deleted as it is copied.
+ */
+static gboolean
+cp_walk (int               src_dfd,
+         int               dest_dfd,
+         const char       *dest_path,
+         GsCpMode          mode,
+         GsCpContext      *ctx,
+         GsPoolWorker     *worker,
+         GCancellable     *cancellable,
+         GError          **error)
+{
+  GSTreeWalker *walker = gs_tree_walker_new (GS_TREE_WALKER_FLAGS_NONE,
+                                             ctx->move ? GS_STAT_ATIME | GS_STAT_MTIME : 0,
+                                             GS_SHUTIL_WALK_MAX_FDS);
+  GsCpWalk walk = { 0, };
+  gboolean ret;
+
+  walk.ctx = ctx;
+  walk.modes = g_array_new (FALSE, FALSE, sizeof (GsCpMode));
+  g_array_append_val (walk.modes, mode);
+  walk.worker = worker;
+  walk.cancellable = cancellable;
+  walk.base_dfd = walk.dest_dfd = dest_dfd;
+  walk.base_path = dest_path;
+  walk.dest_dir = g_string_new ("");
+  walk.dest_ids = g_array_new (FALSE, FALSE, sizeof (GsCpInode));
+  walk.dest_path = g_string_new ("");
+
+  ret = gs_tree_walker_walk (walker, src_dfd, ".", cp_walk_pre, cp_walk_post,
+                             &walk, cancellable, error);
+
+  cp_walk_set_dest_dfd (&walk, dest_dfd);
+  g_string_free (walk.dest_dir, TRUE);
+  g_string_free (walk.dest_path, TRUE);
+  g_array_free (walk.modes, TRUE);
+  g_array_free (walk.dest_ids, TRUE);
+  gs_tree_walker_free (walker);
+  return ret;
+}
+
+static gboolean
+cp_task_run (GsPoolTask    *base,
+             GsPoolWorker  *worker,
+             GCancellable  *cancellable,
+             GError       **error)
+{
+  GsCpTask *task = (GsCpTask *) base;
+  int r;
+
+  switch (task->type)
+    {
+    case GS_CP_TASK_DIR:
+      return cp_populate_dir (&task->src_iter, task->dest_fd, task->dest_path,
+                              task->mode, task->ctx, worker, cancellable, error);
+    case GS_CP_TASK_FILE:
+      if (!copy_regfile_fd (task->src_fd, task->dest_fd, &task->src_stbuf,
+                            task->mode == GS_CP_MODE_COPY_ALL,
+                            (task->ctx->flags & GS_SHUTIL_CP_DURABLE) != 0,
+                            &worker->stats, cancellable, error))
+        return FALSE;
+      r = close (task->dest_fd);
+      task->dest_fd = -1;
+      if (r == -1)
+        {
+          gs_set_prefix_error_from_errno (error, errno, "close");
+          return FALSE;
+        }
+      break;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+cp_internal (GFile            *src,
+             GFile            *dest,
+             GsCpMode          mode,
+             GSShutilCpFlags   flags,
+             int               store_dfd,
+             guint             n_workers,
+             GSShutilProgress *progress,
+             GCancellable     *cancellable,
+             GError          **error)
+{
+  gboolean ret = FALSE;
+  GsCpContext ctx = { 0, };
+  GsCpTask *root;
+
+  ctx.flags = flags;
+  ctx.dest_root_dfd = -1;
+  ctx.store_dfd = store_dfd;
+  g_mutex_init (&ctx.links_lock);
+  ctx.links = g_hash_table_new_full (cp_inode_hash, cp_inode_equal, g_free, g_free);
+
+  root = cp_task_new (GS_CP_TASK_DIR, mode, &ctx);
+  root->dest_path = g_strdup ("");
+
+  if (!gs_dirfd_iterator_init_at (AT_FDCWD, gs_file_get_path_cached (src), TRUE,
+                                  &root->src_iter, error))
+    goto out;
+
+  if (!cp_make_dest_dir (root->src_iter.fd, AT_FDCWD, gs_file_get_path_cached (dest),
+                         mode, flags, &root->dest_fd, cancellable, error))
+    goto out;
+
+  /* The root task may finish before the rest of the tree */
+  ctx.dest_root_dfd = fcntl (root->dest_fd, F_DUPFD_CLOEXEC, 3);
+  if (ctx.dest_root_dfd == -1)
+    {
+      gs_set_prefix_error_from_errno (error, errno, "fcntl");
+      goto out;
+    }
+
+  progress_set_phase (progress, GS_SHUTIL_PHASE_COPY);
+
+  /* Counting needs a worker, so with @progress even a single thread
+   * goes through the pool.
+   */
+  if (n_workers <= 1 && progress == NULL)
+    {
+      if (!cp_walk (root->src_iter.fd, root->dest_fd, root->dest_path, mode,
+                    &ctx, NULL, cancellable, error))
+        goto out;
+    }
+  else
+    {
+      GsCpTask *task = root;
+      root = NULL;
+      if (!pool_run (&task->base, "gs-cp-worker", n_workers, progress,
+                     cancellable, error))
+        goto out;
+    }
+
+  if ((flags & GS_SHUTIL_CP_DURABLE) != 0)
+    {
+      progress_set_phase (progress, GS_SHUTIL_PHASE_SYNC);
+      if (!gs_fd_sync_filesystem (ctx.dest_root_dfd, cancellable, error))
+        goto out;
+    }
+
+  ret = TRUE;
+ out:
+  progress_set_phase (progress, -1);
+  if (root)
+    cp_task_free (root);
+  if (ctx.dest_root_dfd != -1)
+    (void) close (ctx.dest_root_dfd);
+  g_hash_table_unref (ctx.links);
+  g_mutex_clear (&ctx.links_lock);
+  return ret;
+}
+
+/**
+ * gs_shutil_cp_al_or_fallback:
+ * @src: Source path
+ * @dest: Destination path
+ * @cancellable:
+ * @error:
+ *
+ * Recursively copy path @src (which must be a directory) to the
+ * target @dest.  If possible, hardlinks are used; if a hardlink is
+ * not possible, a regular copy is created.  Any existing files are
+ * overwritten.
+ *
+ * Returns: %TRUE on success
+ */
+gboolean
+gs_shutil_cp_al_or_fallback (GFile         *src,
+                             GFile         *dest,
+                             GCancellable  *cancellable,
+                             GError       **error)
+{
+  return cp_internal (src, dest, GS_CP_MODE_HARDLINK, GS_SHUTIL_CP_NONE, -1, 1,
+                      NULL, cancellable, error);
+}
+
+/**
+ * gs_shutil_cp_al_dedup:
+ * @src: Source path
+ * @dest: Destination path
+ * @store: Directory for deduplicated files, on the same filesystem as @dest
+ * @cancellable:
+ * @error:
+ *
+ * Like gs_shutil_cp_al_or_fallback(), but where files cannot be
+ * hardlinked to @src (typically because @dest is on a different
+ * filesystem), regular files are deduplicated through @store
+ * instead.  Each file with new contents is copied once and also
+ * linked into @store, named by the SHA-256 checksums of its contents
+ * and extended attributes, its owner, permissions and modification
+ * time; later files with the same contents and metadata, in this or
+ * any later copy using the same @store, become hardlinks to it.
+ * @store is created if necessary.
+ *
+ * Since hardlinks share all their metadata, only the access time of a
+ * deduplicated file may differ from its source.
+ *
+ * Returns: %TRUE on success
+ */
+gboolean
+gs_shutil_cp_al_dedup (GFile         *src,
+                       GFile         *dest,
+                       GFile         *store,
+                       GCancellable  *cancellable,
+                       GError       **error)
+{
+  gboolean ret = FALSE;
+  int store_dfd = -1;
+
+  if (!gs_file_ensure_directory (store, TRUE, cancellable, error))
+    goto out;
+
+  if (!gs_opendirat (AT_FDCWD, gs_file_get_path_cached (store), TRUE,
+                     &store_dfd, error))
+    goto out;
+
+  if (!cp_internal (src, dest, GS_CP_MODE_HARDLINK, GS_SHUTIL_CP_NONE, store_dfd, 1,
+                    NULL, cancellable, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  if (store_dfd != -1)
+    (void) close (store_dfd);
+  return ret;
+}
+
+/**
+ * gs_shutil_cp_a:
+ * @src: Source path
+ * @dest: Destination path
+ * @cancellable:
+ * @error:
+ *
+ * Recursively copy path @src (which must be a directory) to the
+ * target @dest.  Any existing files are overwritten.  Files with
+ * several links inside @src are copied once, and hardlinked the same
+ * way in @dest.
+ *
+ * Returns: %TRUE on success
+ */
+gboolean
+gs_shutil_cp_a (GFile         *src,
+                GFile         *dest,
+                GCancellable  *cancellable,
+                GError       **error)
+{
+  return cp_internal (src, dest, GS_CP_MODE_COPY_ALL, GS_SHUTIL_CP_NONE, -1, 1,
+                      NULL, cancellable, error);
+}
+
+/**
+ * gs_shutil_cp_a_parallel:
+ * @src: Source path
+ * @dest: Destination path
+ * @flags: Flags
+ * @n_workers: Number of threads to use, or 0 for one per online CPU
+ * @progress: (allow-none): Progress object to update
+ * @cancellable:
+ * @error:
+ *
+ * Like gs_shutil_cp_a(), or gs_shutil_cp_al_or_fallback() if
+ * %GS_SHUTIL_CP_HARDLINK is set in @flags, but copies using a pool of
+ * @n_workers threads.  Subdirectories and large files are queued per
+ * thread, and idle threads steal work from busy ones; this keeps many
+ * I/O requests in flight, which helps on high-latency storage.
+ *
+ * As with gs_shutil_cp_al_or_fallback(), once a hardlink fails, the
+ * rest of that directory and the subdirectories queued after it are
+ * copied instead.
+ *
+ * If %GS_SHUTIL_CP_SYNC is set, @dest may already exist, and is
+ * updated in place to match @src: files whose type, permissions, size
+ * and modification time already match (or which are already
+ * hardlinks to the source) are skipped, and anything in @dest that
+ * is not in @src is deleted.  Add %GS_SHUTIL_CP_SYNC_CHECKSUM to also
+ * compare the contents of such files.  With @n_workers of 1, this is
+ * an incremental version of gs_shutil_cp_a().
+ *
+ * If %GS_SHUTIL_CP_DURABLE is set, writeback of each file is started
+ * as soon as it has been copied, and the destination filesystem is
+ * flushed once at the end with gs_fd_sync_filesystem(); when this
+ * function returns, the whole copy is on stable storage.
+ *
+ * If @progress is given, the entries and bytes handled, and the time
+ * spent, are added to it as the copy goes along.
+ *
+ * Returns: %TRUE on success
+ */
+gboolean
+gs_shutil_cp_a_parallel (GFile            *src,
+                         GFile            *dest,
+                         GSShutilCpFlags   flags,
+                         guint             n_workers,
+                         GSShutilProgress *progress,
+                         GCancellable     *cancellable,
+                         GError          **error)
+{
+  GsCpMode mode = (flags & GS_SHUTIL_CP_HARDLINK) ? GS_CP_MODE_HARDLINK : GS_CP_MODE_COPY_ALL;
+
+  if (n_workers == 0)
+    {
+      long n_cpus = sysconf (_SC_NPROCESSORS_ONLN);
+      n_workers = n_cpus > 0 ? (guint) n_cpus : 1;
+    }
+
+  return cp_internal (src, dest, mode, flags, -1, n_workers,
+                      progress, cancellable, error);
+}
+
+/* A pair of directories being compared by gs_shutil_diff_at().  Their
+ * names are read up front and sorted.  In deep trees, the descriptors
+ * of the shallowest frames are closed, and reopened as ".." on the
+ * way back up; @a_stbuf and @b_stbuf identify them.
+ */
+typedef struct {
+  int a_fd;
+  int b_fd;
+  struct stat a_stbuf;
+  struct stat b_stbuf;
+  GPtrArray *a_names;
+  GPtrArray *b_names;
+  guint a_next;
+  guint b_next;
+  gsize path_len;
+} GsDiffFrame;
+
+static int
+diff_name_compare (gconstpointer a,
+                   gconstpointer b)
+{
+  return strcmp (*(const char **) a, *(const char **) b);
+}
+
+static gboolean
+diff_list_dir (int            dfd,
+               GPtrArray    **out_names,
+               GCancellable  *cancellable,
+               GError       **error)
+{
+  gboolean ret = FALSE;
+  GSDirFdIterator iter = { 0, };
+  GPtrArray *names = g_ptr_array_new_with_free_func (g_free);
+
+  if (!gs_dirfd_iterator_init_at (dfd, ".", FALSE, &iter, error))
+    goto out;
+
+  while (TRUE)
+    {
+      struct dirent *dent;
+
+      if (!gs_dirfd_iterator_next_dent (&iter, &dent, cancellable, error))
+        goto out;
+      if (!dent)
+        break;
+
+      g_ptr_array_add (names, g_strdup (dent->d_name));
+    }
+
+  g_ptr_array_sort (names, diff_name_compare);
+
+  ret = TRUE;
+  *out_names = names;
+  names = NULL;
+ out:
+  gs_dirfd_iterator_clear (&iter);
+  if (names)
+    g_ptr_array_unref (names);
+  return ret;
+}
+
+/* Reopen the directory described by @expected as ".." of @child_fd */
+static gboolean
+diff_reopen_parent (int                 child_fd,
+                    const struct stat  *expected,
+                    int                *out_fd,
+                    GError            **error)
+{
+  struct stat stbuf;
+  int fd;
+
+  do
+    fd = openat (child_fd, "..", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  while (G_UNLIKELY (fd == -1 && errno == EINTR));
+  if (fd == -1)
+    {
+      gs_set_prefix_error_from_errno (error, errno, "openat");
+      return FALSE;
+    }
+  if (fstat (fd, &stbuf) == -1)
+    {
+      gs_set_prefix_error_from_errno (error, errno, "fstat");
+      (void) close (fd);
+      return FALSE;
+    }
+  if (stbuf.st_dev != expected->st_dev || stbuf.st_ino != expected->st_ino)
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                           "Directory moved during comparison");
+      (void) close (fd);
+      return FALSE;
+    }
+
+  *out_fd = fd;
+  return TRUE;
+}
+
+static void
+diff_frame_clear (GsDiffFrame *frame,
+                  guint       *n_open)
+{
+  if (frame->a_fd != -1)
+    {
+      (void) close (frame->a_fd);
+      (*n_open)--;
+    }
+  if (frame->b_fd != -1)
+    (void) close (frame->b_fd);
+  frame->a_fd = frame->b_fd = -1;
+  if (frame->a_names)
+    g_ptr_array_unref (frame->a_names);
+  if (frame->b_names)
+    g_ptr_array_unref (frame->b_names);
+  frame->a_names = frame->b_names = NULL;
+}
+
+/* Open and list the subdirectories @name of the top frame as a new
+ * frame.
+ */
+static gboolean
+diff_push_frame (GArray             *frames,
+                 const char         *name,
+                 const struct stat  *a_stbuf,
+                 const struct stat  *b_stbuf,
+                 gsize               path_len,
+                 guint              *n_open,
+                 GCancellable       *cancellable,
+                 GError            **error)
+{
+  guint top = frames->len - 1;
+  GsDiffFrame *parent;
+  GsDiffFrame *child;
+  guint i;
+
+  /* Keep the parent, which is needed to open the child */
+  for (i = 0; i < top && *n_open >= GS_SHUTIL_WALK_MAX_FDS / 2; i++)
+    {
+      GsDiffFrame *ancestor = &g_array_index (frames, GsDiffFrame, i);
+
+      if (ancestor->a_fd == -1)
+        continue;
+      (void) close (ancestor->a_fd);
+      (void) close (ancestor->b_fd);
+      ancestor->a_fd = ancestor->b_fd = -1;
+      (*n_open)--;
+    }
+
+  g_array_set_size (frames, top + 2);
+  parent = &g_array_index (frames, GsDiffFrame, top);
+  child = &g_array_index (frames, GsDiffFrame, top + 1);
+  child->a_fd = child->b_fd = -1;
+  child->a_stbuf = *a_stbuf;
+  child->b_stbuf = *b_stbuf;
+  child->path_len = path_len;
+
+  if (!gs_opendirat (parent->a_fd, name, FALSE, &child->a_fd, error))
+    return FALSE;
+  (*n_open)++;
+  if (!gs_opendirat (parent->b_fd, name, FALSE, &child->b_fd, error))
+    return FALSE;
+
+  if (!diff_list_dir (child->a_fd, &child->a_names, cancellable, error))
+    return FALSE;
+  if (!diff_list_dir (child->b_fd, &child->b_names, cancellable, error))
+    return FALSE;
+
+  return TRUE;
+}
+
+/* Compare the entries @name of the top frame, which both exist, and
+ * report it if they differ; set @out_push if both are directories,
+ * which need to be compared in turn.
+ */
+static gboolean
+diff_entries (GsDiffFrame        *frame,
+              const char         *name,
+              const char         *path,
+              GsCpCompareFlags    compare,
+              struct stat        *a_stbuf,
+              struct stat        *b_stbuf,
+              gboolean           *out_push,
+              GSShutilDiffFunc    func,
+              gpointer            user_data,
+              GCancellable       *cancellable,
+              GError            **error)
+{
+  gboolean a_exists = TRUE;
+  gboolean b_exists = TRUE;
+  gboolean equal;
+
+  *out_push = FALSE;
+
+  if (fstatat (frame->a_fd, name, a_stbuf, AT_SYMLINK_NOFOLLOW) == -1)
+    {
+      if (errno != ENOENT)
+        {
+          gs_set_prefix_error_from_errno (error, errno, "fstatat");
+          return FALSE;
+        }
+      a_exists = FALSE;
+    }
+  if (fstatat (frame->b_fd, name, b_stbuf, AT_SYMLINK_NOFOLLOW) == -1)
+    {
+      if (errno != ENOENT)
+        {
+          gs_set_prefix_error_from_errno (error, errno, "fstatat");
+          return FALSE;
+        }
+      b_exists = FALSE;
+    }
+
+  /* Either may have been deleted since it was listed */
+  if (!a_exists || !b_exists)
+    {
+      if (a_exists)
+        func (GS_SHUTIL_DIFF_REMOVED, path, user_data);
+      else if (b_exists)
+        func (GS_SHUTIL_DIFF_ADDED, path, user_data);
+      return TRUE;
+    }
+
+  /* The same inode, such as a hardlinked checkout: nothing to do,
+   * even for a whole directory.
+   */
+  if (a_stbuf->st_dev == b_stbuf->st_dev && a_stbuf->st_ino == b_stbuf->st_ino)
+    return TRUE;
+
+  if ((a_stbuf->st_mode & S_IFMT) != (b_stbuf->st_mode & S_IFMT))
+    {
+      func (GS_SHUTIL_DIFF_MODIFIED, path, user_data);
+      return TRUE;
+    }
+
+  if (S_ISDIR (a_stbuf->st_mode))
+    {
+      if ((a_stbuf->st_mode & 07777) != (b_stbuf->st_mode & 07777))
+        func (GS_SHUTIL_DIFF_MODIFIED, path, user_data);
+      *out_push = TRUE;
+      return TRUE;
+    }
+
+  if (!cp_entries_equal (frame->a_fd, a_stbuf, frame->b_fd, b_stbuf, name,
+                         compare, &equal, cancellable, error))
+    return FALSE;
+  if (!equal)
+    func (GS_SHUTIL_DIFF_MODIFIED, path, user_data);
+
+  return TRUE;
+}
+
+/**
+ * gs_shutil_diff_at:
+ * @a_dfd: Directory file descriptor, or -1 for the current directory
+ * @a_path: The first directory, relative to @a_dfd
+ * @b_dfd: Directory file descriptor, or -1 for the current directory
+ * @b_path: The second directory, relative to @b_dfd
+ * @flags: Flags
+ * @func: Called for each difference
+ * @user_data: User data for @func
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Compare two trees, walking both at once, and call @func for each
+ * entry only in @b_path (added), only in @a_path (removed), or
+ * different between them (modified).  Entries are reported
+ * depth-first, sorted by name within each directory, so everything
+ * below "a" comes before "a-b" even though that is not strcmp() order
+ * of the full paths.  Everything below an added or removed directory
+ * is left out.
+ *
+ * Entries differ if their types or permissions do.  Otherwise,
+ * regular files are compared by size and modification time, or with
+ * %GS_SHUTIL_DIFF_CONTENTS, by size and contents; symbolic links by
+ * target, and devices by number, as for %GS_SHUTIL_CP_SYNC.
+ * Ownership is not compared.  Entries which are the same inode are
+ * the same without looking further, so comparing a tree with its
+ * hardlinked copy is cheap.
+ *
+ * Returns: %TRUE on success
+ */
+gboolean
+gs_shutil_diff_at (int                 a_dfd,
+                   const char         *a_path,
+                   int                 b_dfd,
+                   const char         *b_path,
+                   GSShutilDiffFlags   flags,
+                   GSShutilDiffFunc    func,
+                   gpointer            user_data,
+                   GCancellable       *cancellable,
+                   GError            **error)
+{
+  gboolean ret = FALSE;
+  GArray *frames = g_array_new (FALSE, TRUE, sizeof (GsDiffFrame));
+  GString *path = g_string_new ("");
+  GsCpCompareFlags compare = (flags & GS_SHUTIL_DIFF_CONTENTS) ?
+    GS_CP_COMPARE_CONTENTS : GS_CP_COMPARE_MTIME;
+  GsDiffFrame *frame;
+  guint n_open = 0;
+  guint i;
+
+  if (a_dfd == -1)
+    a_dfd = AT_FDCWD;
+  if (b_dfd == -1)
+    b_dfd = AT_FDCWD;
+
+  g_array_set_size (frames, 1);
+  frame = &g_array_index (frames, GsDiffFrame, 0);
+  frame->a_fd = frame->b_fd = -1;
+
+  if (!gs_opendirat (a_dfd, a_path, TRUE, &frame->a_fd, error))
+    goto out;
+  n_open++;
+  if (!gs_opendirat (b_dfd, b_path, TRUE, &frame->b_fd, error))
+    goto out;
+  if (fstat (frame->a_fd, &frame->a_stbuf) == -1 ||
+      fstat (frame->b_fd, &frame->b_stbuf) == -1)
+    {
+      gs_set_prefix_error_from_errno (error, errno, "fstat");
+      goto out;
+    }
+  if (!diff_list_dir (frame->a_fd, &frame->a_names, cancellable, error))
+    goto out;
+  if (!diff_list_dir (frame->b_fd, &frame->b_names, cancellable, error))
+    goto out;
+
+  while (frames->len > 0)
+    {
+      guint top = frames->len - 1;
+      const char *a_name = NULL;
+      const char *b_name = NULL;
+      const char *name;
+      gsize parent_len = path->len;
+      int cmp;
+
+      frame = &g_array_index (frames, GsDiffFrame, top);
+      if (frame->a_next < frame->a_names->len)
+        a_name = frame->a_names->pdata[frame->a_next];
+      if (frame->b_next < frame->b_names->len)
+        b_name = frame->b_names->pdata[frame->b_next];
+
+      if (a_name == NULL && b_name == NULL)
+        {
+          if (top > 0)
+            {
+              GsDiffFrame *parent = &g_array_index (frames, GsDiffFrame, top - 1);
+
+              if (parent->a_fd == -1)
+                {
+                  if (!diff_reopen_parent (frame->a_fd, &parent->a_stbuf, &parent->a_fd, error))
+                    goto out;
+                  n_open++;
+                  if (!diff_reopen_parent (frame->b_fd, &parent->b_stbuf, &parent->b_fd, error))
+                    goto out;
+                }
+              g_string_truncate (path, parent->path_len);
+            }
+          diff_frame_clear (frame, &n_open);
+          g_array_set_size (frames, top);
+          continue;
+        }
+
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        goto out;
+
+      if (a_name && b_name)
+        cmp = strcmp (a_name, b_name);
+      else
+        cmp = a_name ? -1 : 1;
+      name = cmp <= 0 ? a_name : b_name;
+
+      if (path->len > 0)
+        g_string_append_c (path, '/');
+      g_string_append (path, name);
+
+      if (cmp < 0)
+        {
+          frame->a_next++;
+          func (GS_SHUTIL_DIFF_REMOVED, path->str, user_data);
+        }
+      else if (cmp > 0)
+        {
+          frame->b_next++;
+          func (GS_SHUTIL_DIFF_ADDED, path->str, user_data);
+        }
+      else
+        {
+          struct stat a_stbuf;
+          struct stat b_stbuf;
+          gboolean push;
+
+          frame->a_next++;
+          frame->b_next++;
+          if (!diff_entries (frame, name, path->str, compare, &a_stbuf, &b_stbuf,
+                             &push, func, user_data, cancellable, error))
+            goto out;
+
+          if (push)
+            {
+              if (!diff_push_frame (frames, name, &a_stbuf, &b_stbuf, path->len,
+                                    &n_open, cancellable, error))
+                goto out;
+              /* Its path stays until it is done */
+              continue;
+            }
+        }
+
+      g_string_truncate (path, parent_len);
+    }
+
+  ret = TRUE;
+ out:
+  for (i = 0; i < frames->len; i++)
+    diff_frame_clear (&g_array_index (frames, GsDiffFrame, i), &n_open);
+  g_array_free (frames, TRUE);
+  g_string_free (path, TRUE);
+  return ret;
+}
+
+/**
+ * gs_shutil_diff:
+ * @a: The first directory
+ * @b: The second directory
+ * @flags: Flags
+ * @func: Called for each difference
+ * @user_data: User data for @func
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Like gs_shutil_diff_at(), for #GFile.
+ *
+ * Returns: %TRUE on success
+ */
+gboolean
+gs_shutil_diff (GFile              *a,
+                GFile              *b,
+                GSShutilDiffFlags   flags,
+                GSShutilDiffFunc    func,
+                gpointer            user_data,
+                GCancellable       *cancellable,
+                GError            **error)
+{
+  return gs_shutil_diff_at (-1, gs_file_get_path_cached (a),
+                            -1, gs_file_get_path_cached (b),
+                            flags, func, user_data, cancellable, error);
+}
+
+/* gs_shutil_mv_at() for a non-directory: copy it next to @new_path,
+ * rename the copy into place, then delete the original.  Regular
+ * files go through mv_regfile_at().
+ */
+static gboolean
+mv_file_at (int                 old_dfd,
+            const char         *old_path,
+            const struct stat  *stbuf,
+            int                 new_dfd,
+            const char         *new_path,
+            GSRenameFlags       flags,
+            GsCpContext        *ctx,
+            GCancellable       *cancellable,
+            GError            **error)
+{
+  gboolean ret = FALSE;
+  char *old_dir = g_path_get_dirname (old_path);
+  char *old_name = g_path_get_basename (old_path);
+  char *new_dir = g_path_get_dirname (new_path);
+  char *new_name = g_path_get_basename (new_path);
+  char tmp_name[GS_FILEUTIL_TMP_NAME_MAX];
+  gboolean have_tmp = FALSE;
+  int old_dir_fd = -1;
+  int new_dir_fd = -1;
+
+  if (!gs_opendirat (old_dfd, old_dir, TRUE, &old_dir_fd, error) ||
+      !gs_opendirat (new_dfd, new_dir, TRUE, &new_dir_fd, error))
+    goto out;
+
+  if (S_ISREG (stbuf->st_mode))
+    {
+      if (!mv_regfile_at (old_dir_fd, old_name, stbuf, new_dir_fd, new_name,
+                          flags, cancellable, error))
+        goto out;
+    }
+  else
+    {
+      while (TRUE)
+        {
+          GError *local_error = NULL;
+
+          (void) gs_fileutil_gen_tmp_name_buf (NULL, NULL, tmp_name, sizeof (tmp_name));
+          have_tmp = TRUE;
+
+          if (copy_file_at (old_dir_fd, old_name, stbuf, new_dir_fd, tmp_name,
+                            GS_CP_MODE_COPY_ALL, ctx, NULL, cancellable, &local_error))
+            break;
+          if (!g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_EXISTS))
+            {
+              g_propagate_error (error, local_error);
+              goto out;
+            }
+          g_clear_error (&local_error);
+          have_tmp = FALSE;
+        }
+
+      if (gs_renameat_with_errno (new_dir_fd, tmp_name, new_dir_fd, new_name,
+                                  flags & GS_RENAME_NOREPLACE) == -1)
+        {
+          gs_set_prefix_error_from_errno (error, errno, "renameat");
+          goto out;
+        }
+      have_tmp = FALSE;
+    }
+
+  if (unlinkat (old_dir_fd, old_name, 0) == -1)
+    {
+      gs_set_prefix_error_from_errno (error, errno, "unlinkat");
+      goto out;
+    }
+
+  ret = TRUE;
+ out:
+  if (have_tmp)
+    (void) unlinkat (new_dir_fd, tmp_name, 0);
+  if (old_dir_fd != -1)
+    (void) close (old_dir_fd);
+  if (new_dir_fd != -1)
+    (void) close (new_dir_fd);
+  g_free (old_dir);
+  g_free (old_name);
+  g_free (new_dir);
+  g_free (new_name);
+  return ret;
+}
+
+/* gs_shutil_mv_at() for a directory: the destination is created, and
+ * the tree moved into it entry by entry.
+ */
+static gboolean
+mv_dir_at (int             old_dfd,
+           const char     *old_path,
+           int             new_dfd,
+           const char     *new_path,
+           GSRenameFlags   flags,
+           GsCpContext    *ctx,
+           GCancellable   *cancellable,
+           GError        **error)
+{
+  gboolean ret = FALSE;
+  struct stat stbuf;
+  int src_dfd = -1;
+  int dest_dfd = -1;
+
+  if (!gs_opendirat (old_dfd, old_path, FALSE, &src_dfd, error))
+    goto out;
+
+  /* As with rename(), an empty directory may be replaced; with
+   * %GS_RENAME_NOREPLACE, the mkdirat() below fails instead.
+   */
+  if ((flags & GS_RENAME_NOREPLACE) == 0)
+    {
+      if (fstatat (new_dfd, new_path, &stbuf, AT_SYMLINK_NOFOLLOW) == 0)
+        {
+          if (!S_ISDIR (stbuf.st_mode))
+            {
+              gs_set_prefix_error_from_errno (error, ENOTDIR, "renameat");
+              goto out;
+            }
+          if (unlinkat (new_dfd, new_path, AT_REMOVEDIR) == -1)
+            {
+              gs_set_prefix_error_from_errno (error, errno, "unlinkat");
+              goto out;
+            }
+        }
+      else if (errno != ENOENT)
+        {
+          gs_set_prefix_error_from_errno (error, errno, "fstatat");
+          goto out;
+        }
+    }
+
+  if (!cp_make_dest_dir (src_dfd, new_dfd, new_path, GS_CP_MODE_COPY_ALL,
+                         GS_SHUTIL_CP_NONE, &dest_dfd, cancellable, error))
+    goto out;
+
+  ctx->dest_root_dfd = dest_dfd;
+  if (!cp_walk (src_dfd, dest_dfd, "", GS_CP_MODE_COPY_ALL, ctx, NULL,
+                cancellable, error))
+    goto out;
+
+  if (unlinkat (old_dfd, old_path, AT_REMOVEDIR) == -1)
+    {
+      gs_set_prefix_error_from_errno (error, errno, "unlinkat");
+      goto out;
+    }
+
+  ret = TRUE;
+ out:
+  ctx->dest_root_dfd = -1;
+  if (src_dfd != -1)
+    (void) close (src_dfd);
+  if (dest_dfd != -1)
+    (void) close (dest_dfd);
+  return ret;
+}
+
+/**
+ * gs_shutil_mv_at:
+ * @old_dfd: A directory file descriptor, or -1 for current
+ * @old_path: Path to move
+ * @new_dfd: A directory file descriptor, or -1 for current
+ * @new_path: Destination path
+ * @flags: Flags
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Move @old_path, which may be a file or directory, to @new_path,
+ * with the semantics of gs_renameat() and @flags.
+ *
+ * If the two are on different filesystems, @old_path is copied
+ * instead, as gs_shutil_cp_a() would, and deleted as it goes: each
+ * file is removed once its copy is complete, and each directory once
+ * it is empty, so the move never needs space for a second copy of the
+ * tree.  Each regular file is copied to an anonymous file, and only
+ * linked under its name once complete, so if this is interrupted,
+ * every file is complete in one of the two trees.  A non-directory
+ * @old_path is copied to a temporary name and renamed into place, so
+ * @new_path is replaced atomically; a directory @new_path is only
+ * replaced if it is empty.  %GS_RENAME_EXCHANGE cannot be emulated
+ * this way, so then this fails.
+ *
+ * Returns: %TRUE on success
+ */
+gboolean
+gs_shutil_mv_at (int             old_dfd,
+                 const char     *old_path,
+                 int             new_dfd,
+                 const char     *new_path,
+                 GSRenameFlags   flags,
+                 GCancellable   *cancellable,
+                 GError        **error)
+{
+  gboolean ret = FALSE;
+  GsCpContext ctx = { 0, };
+  struct stat stbuf;
+
+  if (old_dfd == -1)
+    old_dfd = AT_FDCWD;
+  if (new_dfd == -1)
+    new_dfd = AT_FDCWD;
+
+  if (gs_renameat_with_errno (old_dfd, old_path, new_dfd, new_path, flags) == 0)
+    return TRUE;
+  if (errno != EXDEV || (flags & GS_RENAME_EXCHANGE) != 0)
+    {
+      gs_set_prefix_error_from_errno (error, errno, "renameat");
+      return FALSE;
+    }
+
+  if (fstatat (old_dfd, old_path, &stbuf, AT_SYMLINK_NOFOLLOW) == -1)
+    {
+      gs_set_prefix_error_from_errno (error, errno, "fstatat");
+      return FALSE;
+    }
+
+  ctx.flags = GS_SHUTIL_CP_NONE;
+  ctx.dest_root_dfd = -1;
+  ctx.store_dfd = -1;
+  ctx.move = TRUE;
+  g_mutex_init (&ctx.links_lock);
+  ctx.links = g_hash_table_new_full (cp_inode_hash, cp_inode_equal, g_free, g_free);
+
+  if (S_ISDIR (stbuf.st_mode))
+    {
+      if (!mv_dir_at (old_dfd, old_path, new_dfd, new_path, flags, &ctx,
+                      cancellable, error))
+        goto out;
+    }
+  else
+    {
+      if (!mv_file_at (old_dfd, old_path, &stbuf, new_dfd, new_path, flags, &ctx,
+                       cancellable, error))
+        goto out;
+    }
+
+  ret = TRUE;
+ out:
+  g_hash_table_unref (ctx.links);
+  g_mutex_clear (&ctx.links_lock);
+  return ret;
+}
+
+/**
+ * gs_shutil_mv:
+ * @src: Source path
+ * @dest: Destination path
+ * @flags: Flags
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Move @src to @dest; see gs_shutil_mv_at().
+ *
+ * Returns: %TRUE on success
+ */
+gboolean
+gs_shutil_mv (GFile          *src,
+              GFile          *dest,
+              GSRenameFlags   flags,
+              GCancellable   *cancellable,
+              GError        **error)
+{
+  return gs_shutil_mv_at (-1, gs_file_get_path_cached (src),
+                          -1, gs_file_get_path_cached (dest),
+                          flags, cancellable, error);
+}
+
+static gboolean
+rm_walk_pre (GSTreeWalker             *walker,
+             const GSTreeWalkerEntry  *entry,
+             gpointer                  user_data,
+             GError                  **error)
+{
+  GSShutilStats *stats = user_data;
+
+  if (entry->type == DT_DIR)
+    return TRUE;
+
+  if (unlinkat (entry->dfd, entry->name, 0) == -1 && errno != ENOENT)
+    {
+      gs_set_prefix_error_from_errno (error, errno, "unlinkat");
+      return FALSE;
+    }
+  if (stats)
+    {
+      stats->n_files++;
+      stats->n_deleted++;
+    }
+  return TRUE;
+}
+
+static gboolean
+rm_walk_post (GSTreeWalker             *walker,
+              const GSTreeWalkerEntry  *entry,
+              gpointer                  user_data,
+              GError                  **error)
+{
+  GSShutilStats *stats = user_data;
+
+  if (unlinkat (entry->dfd, entry->name, AT_REMOVEDIR) == -1 && errno != ENOENT)
+    {
+      gs_set_prefix_error_from_errno (error, errno, "unlinkat");
+      return FALSE;
+    }
+  if (stats)
+    {
+      stats->n_directories++;
+      stats->n_deleted++;
+    }
+  return TRUE;
+}
+
+/* Delete @path in @dfd, walking it iteratively; if @stats is given,
+ * count what was deleted there.
+ */
+static gboolean
+rm_walk (int             dfd,
+         const char     *path,
+         GSShutilStats  *stats,
+         GCancellable   *cancellable,
+         GError        **error)
+{
+  GSTreeWalker *walker = gs_tree_walker_new (GS_TREE_WALKER_FLAGS_NONE, 0,
+                                             GS_SHUTIL_WALK_MAX_FDS);
+  GError *local_error = NULL;
+  gboolean ret = TRUE;
+
+  if (!gs_tree_walker_walk (walker, dfd, path, rm_walk_pre, rm_walk_post,
+                            stats, cancellable, &local_error))
+    {
+      /* Entries that vanish are skipped, so this is the root */
+      if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        g_clear_error (&local_error);
+      else
+        {
+          g_propagate_error (error, local_error);
+          ret = FALSE;
+        }
+    }
+
+  gs_tree_walker_free (walker);
+  return ret;
+}
+
+typedef struct _GsRmDir GsRmDir;
+
+/* A directory being deleted by gs_shutil_rm_rf_at_parallel().  Its
+ * listing task holds one reference, and every child directory holds
+ * another; whoever drops the last one removes the (by then empty)
+ * directory.  @parent_dfd is the iterator fd of @parent, which the
+ * reference keeps open.  @pool is only set once the task runs.
+ */
+struct _GsRmDir {
+  GsPoolTask base;
+  GsPool *pool;
+  GsRmDir *parent;
+  int parent_dfd;
+  char *name;
+  GSDirFdIterator iter;
+  gboolean listed;  /* All entries have been handled */
+  volatile gint refcount;
+};
+
+static gboolean
+rm_dir_run (GsPoolTask    *base,
+            GsPoolWorker  *worker,
+            GCancellable  *cancellable,
+            GError       **error);
+
+static void
+rm_dir_unref (GsRmDir *dir);
+
+static GsRmDir *
+rm_dir_new (GsRmDir     *parent,
+            int          parent_dfd,
+            const char  *name)
+{
+  GsRmDir *dir = g_new0 (GsRmDir, 1);
+  dir->base.run = rm_dir_run;
+  dir->base.destroy = (GDestroyNotify) rm_dir_unref;
+  if (parent)
+    {
+      g_atomic_int_inc (&parent->refcount);
+      dir->parent = parent;
+    }
+  dir->parent_dfd = parent_dfd;
+  dir->name = g_strdup (name);
+  dir->refcount = 1;
+  return dir;
+}
+
+static void
+rm_dir_unref (GsRmDir *dir)
+{
+  /* Walk upwards iteratively, so that finishing a deep chain of
+   * directories does not recurse.
+   */
+  while (dir && g_atomic_int_dec_and_test (&dir->refcount))
+    {
+      GsRmDir *parent = dir->parent;
+      GsPool *pool = dir->pool;
+
+      if (dir->iter.initialized)
+        {
+          gs_dirfd_iterator_clear (&dir->iter);
+          g_atomic_int_add (&pool->n_held, -1);
+        }
+
+      if (dir->listed && !g_atomic_int_get (&pool->failed) &&
+          unlinkat (dir->parent_dfd, dir->name, AT_REMOVEDIR) == -1 &&
+          errno != ENOENT)
+        {
+          GError *local_error = NULL;
+          gs_set_prefix_error_from_errno (&local_error, errno, "unlinkat");
+          pool_take_error (pool, local_error);
+        }
+
+      g_free (dir->name);
+      g_free (dir);
+      dir = parent;
+    }
+}
+
+static gboolean
+rm_dir_run (GsPoolTask    *base,
+            GsPoolWorker  *worker,
+            GCancellable  *cancellable,
+            GError       **error)
+{
+  GsRmDir *dir = (GsRmDir *) base;
+
+  dir->pool = worker->pool;
+
+  if (!gs_dirfd_iterator_init_at (dir->parent_dfd, dir->name, FALSE, &dir->iter, error))
+    return FALSE;
+  g_atomic_int_inc (&dir->pool->n_held);
+
+  while (TRUE)
+    {
+      struct dirent *dent;
+      unsigned char d_type;
+      gboolean can_hold;
+
+      if (pool_check_failed (worker, error))
+        return FALSE;
+
+      if (!gs_dirfd_iterator_next_dent (&dir->iter, &dent, cancellable, error))
+        return FALSE;
+      if (!dent)
+        break;
+
+      d_type = dent->d_type;
+      if (d_type == DT_UNKNOWN)
+        {
+          GError *local_error = NULL;
+          GSStat st;
+
+          /* Only the type is needed, which is cheap on any filesystem */
+          if (!gs_stat_at (dir->iter.fd, dent->d_name, AT_SYMLINK_NOFOLLOW,
+                           GS_STAT_TYPE, &st, &local_error))
+            {
+              if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+                {
+                  g_clear_error (&local_error);
+                  continue;
+                }
+              g_propagate_error (error, local_error);
+              return FALSE;
+            }
+          d_type = IFTODT (st.mode);
+        }
+
+      if (d_type == DT_DIR)
+        {
+          /* Past the budget, the subtree is walked with a bounded
+           * number of descriptors instead.
+           */
+          can_hold = (g_atomic_int_get (&dir->pool->n_held) <
+                      (gint) (dir->pool->n_workers * GS_POOL_MAX_HELD_PER_WORKER));
+
+          if (can_hold && pool_can_push (dir->pool))
+            {
+              GsRmDir *child = rm_dir_new (dir, dir->iter.fd, dent->d_name);
+              pool_push (worker, &child->base);
+            }
+          else if (can_hold && worker->inline_depth < GS_POOL_MAX_INLINE_DEPTH)
+            {
+              GsRmDir *child = rm_dir_new (dir, dir->iter.fd, dent->d_name);
+              gboolean child_ok;
+
+              worker->inline_depth++;
+              child_ok = rm_dir_run (&child->base, worker, cancellable, error);
+              worker->inline_depth--;
+              rm_dir_unref (child);
+              if (!child_ok)
+                return FALSE;
+            }
+          else if (!rm_walk (dir->iter.fd, dent->d_name, &worker->stats,
+                             cancellable, error))
+            return FALSE;
+        }
+      else
+        {
+          if (unlinkat (dir->iter.fd, dent->d_name, 0) == -1 && errno != ENOENT)
+            {
+              gs_set_prefix_error_from_errno (error, errno, "unlinkat");
+              return FALSE;
+            }
+          worker->stats.n_files++;
+          worker->stats.n_deleted++;
+        }
+
+      pool_worker_flush_stats (worker, FALSE);
+    }
+
+  /* Counted now, though it is only removed once its children are */
+  worker->stats.n_directories++;
+  worker->stats.n_deleted++;
+  dir->listed = TRUE;
+  return TRUE;
+}
+
+/**
+ * gs_shutil_rm_rf_at:
+ * @dfd: A directory file descriptor, or -1 for current
+ * @path: Path
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Recursively delete the filename referenced by the combination of
+ * the directory fd@dfd and @path; it may be a file or directory.  No
+ * error is thrown if @path does not exist.
+ *
+ * The tree is walked with a #GSTreeWalker, so neither stack space
+ * nor file descriptors limit how deep it may be.
+ */
+gboolean
+gs_shutil_rm_rf_at (int           dfd,
+                    const char   *path,
+                    GCancellable *cancellable,
+                    GError      **error)
+{
+  return rm_walk (dfd, path, NULL, cancellable, error);
+}
+
+/**
+ * gs_shutil_rm_rf_at_parallel:
+ * @dfd: A directory file descriptor, or -1 for current
+ * @path: Path
+ * @n_workers: Number of threads to use, or 0 for one per online CPU
+ * @progress: (allow-none): Progress object to update
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Like gs_shutil_rm_rf_at(), but deletes directories using a pool of
+ * @n_workers threads.  Each directory is listed by one thread, its
+ * subdirectories are queued for the others, and it is removed by
+ * whichever thread finishes its last child.  This is mainly useful
+ * for huge trees on storage that can service many metadata requests
+ * at once.  No error is thrown if @path does not exist.
+ *
+ * Returns: %TRUE on success
+ */
+gboolean
+gs_shutil_rm_rf_at_parallel (int                dfd,
+                             const char        *path,
+                             guint              n_workers,
+                             GSShutilProgress  *progress,
+                             GCancellable      *cancellable,
+                             GError           **error)
+{
+  gboolean ret = FALSE;
+  struct stat stbuf;
+  GsRmDir *root;
+
+  if (n_workers == 0)
+    {
+      long n_cpus = sysconf (_SC_NPROCESSORS_ONLN);
+      n_workers = n_cpus > 0 ? (guint) n_cpus : 1;
+    }
+
+  if (n_workers <= 1 && progress == NULL)
+    return gs_shutil_rm_rf_at (dfd, path, cancellable, error);
+
+  if (dfd == -1)
+    dfd = AT_FDCWD;
+
+  progress_set_phase (progress, GS_SHUTIL_PHASE_DELETE);
+
+  if (fstatat (dfd, path, &stbuf, AT_SYMLINK_NOFOLLOW) == -1)
+    {
+      if (errno != ENOENT)
+        {
+          gs_set_prefix_error_from_errno (error, errno, "fstatat");
+          goto out;
+        }
+    }
+  else if (!S_ISDIR (stbuf.st_mode))
+    {
+      if (unlinkat (dfd, path, 0) == -1 && errno != ENOENT)
+        {
+          gs_set_prefix_error_from_errno (error, errno, "unlinkat");
+          goto out;
+        }
+      if (progress)
+        {
+          GSShutilStats delta = { 0, };
+          delta.n_files = delta.n_deleted = 1;
+          progress_merge (progress, &delta, FALSE);
+        }
+    }
+  else
+    {
+      root = rm_dir_new (NULL, dfd, path);
+      if (!pool_run (&root->base, "gs-rm-worker", n_workers, progress,
+                     cancellable, error))
+        goto out;
+    }
+
+  ret = TRUE;
+ out:
+  progress_set_phase (progress, -1);
+  return ret;
+}
+
+/**
+ * gs_shutil_rm_rf:
+ * @path: A file or directory
+ * @cancellable:
+ * @error:
+ *
+ * Recursively delete the filename referenced by @path; it may be a
+ * file or directory.  No error is thrown if @path does not exist.
+ */
+gboolean
+gs_shutil_rm_rf (GFile        *path,
+                 GCancellable *cancellable,
+                 GError      **error)
+{
+  return gs_shutil_rm_rf_at (-1, gs_file_get_path_cached (path), cancellable, error);
+}
+
+
+/* Large enough for any #GChecksumType */
+#define GS_SUM_MAX_DIGEST 64
+
+typedef struct _GsSumEntry GsSumEntry;
+
+/* An entry of a tree being checksummed.  @digest covers the contents
+ * of a regular file, the target of a symbolic link, or the record of
+ * a directory; see gs_shutil_checksum_tree_at().
+ */
+struct _GsSumEntry {
+  char *path;
+  const char *name;      /* Last component of @path */
+  guint8 type;
+  guint32 mode;
+  guint32 uid;
+  guint32 gid;
+  guint64 rdev;
+  guint8 digest[GS_SUM_MAX_DIGEST];
+  guint8 xattrs_digest[GS_SUM_MAX_DIGEST];
+  GPtrArray *children;   /* Directories only */
+};
+
+/* State shared by a whole tree checksum.  Entries are only added by
+ * the thread doing the walk, and only read once the pool is done.
+ */
+typedef struct {
+  GChecksumType checksum_type;
+  gsize digest_len;
+  GSShutilChecksumFlags flags;
+  int dfd;
+  const char *path;
+  GPtrArray *entries;    /* Owns all of them */
+  GPtrArray *dirs;       /* In pre-order, so parents come first */
+  GPtrArray *stack;      /* Directories above the current entry */
+} GsSumContext;
+
+/* The walk of the tree if @entry is %NULL, otherwise the contents of
+ * the regular file @entry, open as @fd.
+ */
+typedef struct {
+  GsPoolTask base;
+  GsSumContext *ctx;
+  GsSumEntry *entry;
+  int fd;
+} GsSumTask;
+
+typedef struct {
+  GsSumContext *ctx;
+  GsPoolWorker *worker;
+  GCancellable *cancellable;
+} GsSumWalk;
+
+static void
+sum_entry_free (GsSumEntry *entry)
+{
+  if (entry->children)
+    g_ptr_array_unref (entry->children);
+  g_free (entry->path);
+  g_free (entry);
+}
+
+static void
+sum_task_free (GsSumTask *task)
+{
+  if (task->fd != -1)
+    (void) close (task->fd);
+  g_free (task);
+}
+
+static void
+sum_finish (GsSumContext *ctx,
+            GChecksum    *checksum,
+            guint8       *out_digest)
+{
+  gsize len = ctx->digest_len;
+  g_checksum_get_digest (checksum, out_digest, &len);
+}
+
+static void
+sum_xattrs (GsSumContext *ctx,
+            GVariant     *xattrs,
+            guint8       *out_digest)
+{
+  GChecksum *checksum = g_checksum_new (ctx->checksum_type);
+
+  /* Already in a canonical order */
+  g_checksum_update (checksum, g_variant_get_data (xattrs), g_variant_get_size (xattrs));
+  sum_finish (ctx, checksum, out_digest);
+  g_checksum_free (checksum);
+}
+
+static gboolean
+sum_file_run (GsPoolTask    *base,
+              GsPoolWorker  *worker,
+              GCancellable  *cancellable,
+              GError       **error)
+{
+  GsSumTask *task = (GsSumTask *) base;
+  GsSumContext *ctx = task->ctx;
+  GChecksum *checksum = g_checksum_new (ctx->checksum_type);
+  GVariant *xattrs = NULL;
+  gboolean ret = FALSE;
+
+  (void) posix_fadvise (task->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  if (!checksum_update_from_fd (checksum, task->fd, &worker->stats, cancellable, error))
+    goto out;
+  sum_finish (ctx, checksum, task->entry->digest);
+
+  if ((ctx->flags & GS_SHUTIL_CHECKSUM_XATTRS) != 0)
+    {
+      if (!gs_fd_get_all_xattrs (task->fd, &xattrs, cancellable, error))
+        goto out;
+      sum_xattrs (ctx, xattrs, task->entry->xattrs_digest);
+    }
+
+  worker->stats.n_files++;
+
+  ret = TRUE;
+ out:
+  if (xattrs)
+    g_variant_unref (xattrs);
+  g_checksum_free (checksum);
+  return ret;
+}
+
+/* Record @entry, and checksum it unless it is a directory or regular
+ * file; those are done later, and by the pool, respectively.
+ */
+static gboolean
+sum_walk_pre (GSTreeWalker             *walker,
+              const GSTreeWalkerEntry  *entry,
+              gpointer                  user_data,
+              GError                  **error)
+{
+  GsSumWalk *walk = user_data;
+  GsSumContext *ctx = walk->ctx;
+  GsSumEntry *sum;
+  GsSumTask *task = NULL;
+  gboolean ret = FALSE;
+
+  if (pool_check_failed (walk->worker, error))
+    goto out;
+
+  if (entry->depth == 0 && entry->type != DT_DIR)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_DIRECTORY,
+                   "Not a directory: %s", entry->name);
+      goto out;
+    }
+
+  if (entry->type == DT_REG)
+    {
+      GError *local_error = NULL;
+
+      task = g_new0 (GsSumTask, 1);
+      task->base.run = sum_file_run;
+      task->base.destroy = (GDestroyNotify) sum_task_free;
+      task->ctx = ctx;
+      task->fd = -1;
+      if (!gs_file_openat_noatime (entry->dfd, entry->name, &task->fd,
+                                   walk->cancellable, &local_error))
+        {
+          /* Deleted since it was listed */
+          if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+            {
+              g_clear_error (&local_error);
+              ret = TRUE;
+            }
+          else
+            g_propagate_error (error, local_error);
+          goto out;
+        }
+    }
+
+  sum = g_new0 (GsSumEntry, 1);
+  sum->path = g_strdup (entry->path);
+  sum->name = entry->depth == 0 ? sum->path : sum->path + strlen (sum->path) - strlen (entry->name);
+  sum->type = entry->type;
+  if (entry->stat)
+    {
+      sum->mode = entry->stat->mode;
+      sum->uid = entry->stat->uid;
+      sum->gid = entry->stat->gid;
+      sum->rdev = entry->stat->rdev;
+    }
+  g_ptr_array_add (ctx->entries, sum);
+
+  g_ptr_array_set_size (ctx->stack, entry->depth);
+  if (entry->depth > 0)
+    g_ptr_array_add (((GsSumEntry *) ctx->stack->pdata[entry->depth - 1])->children, sum);
+
+  if (entry->depth > 0 && entry->type != DT_REG &&
+      (ctx->flags & GS_SHUTIL_CHECKSUM_XATTRS) != 0)
+    {
+      GVariant *xattrs = NULL;
+
+      if (!gs_dfd_and_name_get_all_xattrs (entry->dfd, entry->name, &xattrs,
+                                           walk->cancellable, error))
+        goto out;
+      sum_xattrs (ctx, xattrs, sum->xattrs_digest);
+      g_variant_unref (xattrs);
+    }
+
+  if (entry->type == DT_DIR)
+    {
+      sum->children = g_ptr_array_new ();
+      g_ptr_array_add (ctx->stack, sum);
+      g_ptr_array_add (ctx->dirs, sum);
+      walk->worker->stats.n_directories++;
+    }
+  else if (entry->type == DT_REG)
+    {
+      task->entry = sum;
+      if (pool_can_push (walk->worker->pool))
+        {
+          pool_push (walk->worker, &task->base);
+          task = NULL;
+        }
+      else if (!sum_file_run (&task->base, walk->worker, walk->cancellable, error))
+        goto out;
+    }
+  else
+    {
+      GChecksum *checksum = g_checksum_new (ctx->checksum_type);
+
+      if (entry->type == DT_LNK)
+        {
+          char target[PATH_MAX + 1];
+          ssize_t len;
+
+          len = _gs_readlinkat_buf (entry->dfd, entry->name, target,
+                                    sizeof (target), error);
+          if (len == -1)
+            {
+              g_checksum_free (checksum);
+              goto out;
+            }
+          g_checksum_update (checksum, (guint8 *) target, len);
+        }
+      sum_finish (ctx, checksum, sum->digest);
+      g_checksum_free (checksum);
+      walk->worker->stats.n_files++;
+    }
+
+  pool_worker_flush_stats (walk->worker, FALSE);
+
+  ret = TRUE;
+ out:
+  if (task)
+    sum_task_free (task);
+  return ret;
+}
+
+static gboolean
+sum_walk_run (GsPoolTask    *base,
+              GsPoolWorker  *worker,
+              GCancellable  *cancellable,
+              GError       **error)
+{
+  GsSumTask *task = (GsSumTask *) base;
+  GsSumContext *ctx = task->ctx;
+  GSTreeWalker *walker;
+  GsSumWalk walk = { 0, };
+  gboolean ret;
+
+  walker = gs_tree_walker_new (GS_TREE_WALKER_FLAGS_FOLLOW_ROOT,
+                               (ctx->flags & GS_SHUTIL_CHECKSUM_METADATA) ?
+                               GS_STAT_MODE | GS_STAT_UID | GS_STAT_GID : 0,
+                               GS_SHUTIL_WALK_MAX_FDS);
+  walk.ctx = ctx;
+  walk.worker = worker;
+  walk.cancellable = cancellable;
+  ret = gs_tree_walker_walk (walker, ctx->dfd, ctx->path, sum_walk_pre, NULL,
+                             &walk, cancellable, error);
+  gs_tree_walker_free (walker);
+  return ret;
+}
+
+static int
+sum_entry_compare (gconstpointer a,
+                   gconstpointer b)
+{
+  const GsSumEntry *entry_a = *(GsSumEntry **) a;
+  const GsSumEntry *entry_b = *(GsSumEntry **) b;
+  return strcmp (entry_a->name, entry_b->name);
+}
+
+static char
+sum_type_char (guint8 type)
+{
+  switch (type)
+    {
+    case DT_DIR: return 'd';
+    case DT_REG: return 'f';
+    case DT_LNK: return 'l';
+    case DT_CHR: return 'c';
+    case DT_BLK: return 'b';
+    case DT_FIFO: return 'p';
+    case DT_SOCK: return 's';
+    default: return '?';
+    }
+}
+
+static char *
+sum_to_hex (GsSumContext *ctx,
+            const guint8 *digest)
+{
+  static const char hex[] = "0123456789abcdef";
+  char *ret = g_malloc (ctx->digest_len * 2 + 1);
+  gsize i;
+
+  for (i = 0; i < ctx->digest_len; i++)
+    {
+      ret[i * 2] = hex[digest[i] >> 4];
+      ret[i * 2 + 1] = hex[digest[i] & 0xf];
+    }
+  ret[i * 2] = '\0';
+  return ret;
+}
+
+/* Compute the digest of @dir from those of its children, and add the
+ * files among them to @checksums, if given.
+ */
+static void
+sum_dir (GsSumContext *ctx,
+         GsSumEntry   *dir,
+         GHashTable   *checksums)
+{
+  GChecksum *checksum = g_checksum_new (ctx->checksum_type);
+  guint i;
+
+  g_ptr_array_sort (dir->children, sum_entry_compare);
+
+  for (i = 0; i < dir->children->len; i++)
+    {
+      GsSumEntry *child = dir->children->pdata[i];
+      guint8 type = sum_type_char (child->type);
+
+      g_checksum_update (checksum, &type, 1);
+      g_checksum_update (checksum, (guint8 *) child->name, strlen (child->name) + 1);
+      g_checksum_update (checksum, child->digest, ctx->digest_len);
+
+      if ((ctx->flags & GS_SHUTIL_CHECKSUM_METADATA) != 0)
+        {
+          guint32 metadata[3];
+          metadata[0] = GUINT32_TO_BE (child->mode);
+          metadata[1] = GUINT32_TO_BE (child->uid);
+          metadata[2] = GUINT32_TO_BE (child->gid);
+          g_checksum_update (checksum, (guint8 *) metadata, sizeof (metadata));
+
+          if (child->type == DT_CHR || child->type == DT_BLK)
+            {
+              guint64 rdev = GUINT64_TO_BE (child->rdev);
+              g_checksum_update (checksum, (guint8 *) &rdev, sizeof (rdev));
+            }
+        }
+
+      if ((ctx->flags & GS_SHUTIL_CHECKSUM_XATTRS) != 0)
+        g_checksum_update (checksum, child->xattrs_digest, ctx->digest_len);
+
+      if (checksums && (child->type == DT_REG || child->type == DT_LNK))
+        g_hash_table_insert (checksums, g_strdup (child->path),
+                             sum_to_hex (ctx, child->digest));
+    }
+
+  sum_finish (ctx, checksum, dir->digest);
+  g_checksum_free (checksum);
+}
+
+/**
+ * gs_shutil_checksum_tree_at:
+ * @dfd: Directory file descriptor, or -1 for the current directory
+ * @path: Path of a directory, relative to @dfd
+ * @checksum_type: Checksum to use
+ * @flags: What to cover besides names, file types and contents
+ * @n_workers: Number of threads, or 0 for one per CPU
+ * @progress: (allow-none): Where to report progress
+ * @out_checksums: (out) (allow-none) (transfer full): Checksums of regular files and symbolic links
+ * @out_root_checksum: (out) (allow-none): Checksum of the whole tree
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Checksum the tree at @path.  One thread walks it, and the contents
+ * of regular files are read and checksummed by all @n_workers, so
+ * that a large tree is limited by the storage rather than by one CPU.
+ *
+ * @out_checksums maps the path of each regular file and symbolic
+ * link, relative to @path, to the hex checksum of its contents, or
+ * of its target.
+ *
+ * @out_root_checksum is a Merkle tree root: each directory is
+ * checksummed as the list of its entries, sorted by name, each being
+ * its type, its name, the checksum of its contents, target or
+ * directory, and depending on @flags, its mode, ownership and device
+ * number, and the checksum of its extended attributes.  It is stable
+ * across runs and filesystems, and any change in the tree (apart
+ * from the metadata of @path itself) changes it.
+ *
+ * Returns: %TRUE on success
+ */
+gboolean
+gs_shutil_checksum_tree_at (int                     dfd,
+                            const char             *path,
+                            GChecksumType           checksum_type,
+                            GSShutilChecksumFlags   flags,
+                            guint                   n_workers,
+                            GSShutilProgress       *progress,
+                            GHashTable            **out_checksums,
+                            char                  **out_root_checksum,
+                            GCancellable           *cancellable,
+                            GError                **error)
+{
+  gboolean ret = FALSE;
+  GsSumContext ctx = { 0, };
+  GsSumTask *root;
+  GHashTable *checksums = NULL;
+  guint i;
+
+  if (n_workers == 0)
+    {
+      long n_cpus = sysconf (_SC_NPROCESSORS_ONLN);
+      n_workers = n_cpus > 0 ? (guint) n_cpus : 1;
+    }
+
+  ctx.checksum_type = checksum_type;
+  ctx.digest_len = g_checksum_type_get_length (checksum_type);
+  g_return_val_if_fail (ctx.digest_len <= GS_SUM_MAX_DIGEST, FALSE);
+  ctx.flags = flags;
+  ctx.dfd = dfd == -1 ? AT_FDCWD : dfd;
+  ctx.path = path;
+  ctx.entries = g_ptr_array_new_with_free_func ((GDestroyNotify) sum_entry_free);
+  ctx.dirs = g_ptr_array_new ();
+  ctx.stack = g_ptr_array_new ();
+
+  progress_set_phase (progress, GS_SHUTIL_PHASE_CHECKSUM);
+
+  root = g_new0 (GsSumTask, 1);
+  root->base.run = sum_walk_run;
+  root->base.destroy = (GDestroyNotify) sum_task_free;
+  root->ctx = &ctx;
+  root->fd = -1;
+  if (!pool_run (&root->base, "gs-checksum-worker", n_workers, progress,
+                 cancellable, error))
+    goto out;
+
+  if (out_checksums)
+    checksums = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+  /* Children before their parents */
+  for (i = ctx.dirs->len; i > 0; i--)
+    sum_dir (&ctx, ctx.dirs->pdata[i - 1], checksums);
+
+  ret = TRUE;
+  if (out_checksums)
+    {
+      *out_checksums = checksums;
+      checksums = NULL;
+    }
+  if (out_root_checksum)
+    *out_root_checksum = sum_to_hex (&ctx, ((GsSumEntry *) ctx.dirs->pdata[0])->digest);
+ out:
+  progress_set_phase (progress, -1);
+  if (checksums)
+    g_hash_table_unref (checksums);
+  g_ptr_array_unref (ctx.stack);
+  g_ptr_array_unref (ctx.dirs);
+  g_ptr_array_unref (ctx.entries);
+  return ret;
+}
+
+/* Everything gs_shutil_du_at() needs to know about an entry */
+#define GS_DU_STAT_MASK (GS_STAT_TYPE | GS_STAT_NLINK | GS_STAT_INO | \
+                         GS_STAT_SIZE | GS_STAT_BLOCKS)
+
+/* State shared by a whole disk usage walk.  Each worker adds to its
+ * own totals, and only inodes with more than one link go through the
+ * shared table.
+ */
+typedef struct {
+  GSShutilDiskUsage *usage;  /* One per worker */
+  GMutex inodes_lock;
+  GHashTable *inodes;
+} GsDuContext;
+
+typedef struct {
+  GsPoolTask base;
+  GsDuContext *ctx;
+  GSDirFdIterator iter;
+} GsDuTask;
+
+typedef struct {
+  GsDuContext *ctx;
+  GsPoolWorker *worker;
+} GsDuWalk;
+
+static void
+du_account (GsDuContext       *ctx,
+            GSShutilDiskUsage *usage,
+            const GSStat      *st)
+{
+  guint64 allocated = st->blocks * 512;
+  gboolean unique = TRUE;
+
+  if (S_ISDIR (st->mode))
+    usage->n_directories++;
+  else
+    usage->n_files++;
+  usage->apparent_bytes += st->size;
+  usage->allocated_bytes += allocated;
+
+  if (!S_ISDIR (st->mode) && st->nlink > 1)
+    {
+      GsCpInode key = { st->dev, st->ino };
+
+      g_mutex_lock (&ctx->inodes_lock);
+      unique = !g_hash_table_lookup (ctx->inodes, &key);
+      if (unique)
+        g_hash_table_insert (ctx->inodes, g_memdup (&key, sizeof (key)), GINT_TO_POINTER (1));
+      g_mutex_unlock (&ctx->inodes_lock);
+    }
+
+  if (unique)
+    {
+      usage->n_inodes++;
+      usage->unique_apparent_bytes += st->size;
+      usage->unique_allocated_bytes += allocated;
+    }
+}
+
+static gboolean
+du_walk_pre (GSTreeWalker             *walker,
+             const GSTreeWalkerEntry  *entry,
+             gpointer                  user_data,
+             GError                  **error)
+{
+  GsDuWalk *walk = user_data;
+
+  /* Already counted by the caller */
+  if (entry->depth == 0)
+    return TRUE;
+
+  du_account (walk->ctx, &walk->ctx->usage[walk->worker->index], entry->stat);
+  if (entry->type == DT_DIR)
+    walk->worker->stats.n_directories++;
+  else
+    walk->worker->stats.n_files++;
+  pool_worker_flush_stats (walk->worker, FALSE);
+  return !pool_check_failed (walk->worker, error);
+}
+
+/* Measure everything below @dfd/@name, without recursing */
+static gboolean
+du_walk (int             dfd,
+         const char     *name,
+         GsDuContext    *ctx,
+         GsPoolWorker   *worker,
+         GCancellable   *cancellable,
+         GError        **error)
+{
+  GSTreeWalker *walker = gs_tree_walker_new (GS_TREE_WALKER_FLAGS_NONE, GS_DU_STAT_MASK,
+                                             GS_SHUTIL_WALK_MAX_FDS);
+  GsDuWalk walk = { ctx, worker };
+  gboolean ret;
+
+  ret = gs_tree_walker_walk (walker, dfd, name, du_walk_pre, NULL, &walk,
+                             cancellable, error);
+  gs_tree_walker_free (walker);
+  return ret;
+}
+
+static gboolean
+du_task_run (GsPoolTask    *base,
+             GsPoolWorker  *worker,
+             GCancellable  *cancellable,
+             GError       **error);
+
+static void
+du_task_free (GsDuTask *task)
+{
+  gs_dirfd_iterator_clear (&task->iter);
+  g_free (task);
+}
+
+/* Measure the entries of @iter; subdirectories are queued for other
+ * workers, or measured inline.
+ */
+static gboolean
+du_dir (GSDirFdIterator  *iter,
+        GsDuContext      *ctx,
+        GsPoolWorker     *worker,
+        GCancellable     *cancellable,
+        GError          **error)
+{
+  GSShutilDiskUsage *usage = &ctx->usage[worker->index];
+
+  while (TRUE)
+    {
+      struct dirent *dent;
+      GSStat st;
+
+      if (pool_check_failed (worker, error))
+        return FALSE;
+
+      if (!gs_dirfd_iterator_next_stat (iter, GS_DU_STAT_MASK, &dent, &st,
+                                        cancellable, error))
+        return FALSE;
+      if (!dent)
+        break;
+
+      du_account (ctx, usage, &st);
+
+      if (S_ISDIR (st.mode))
+        {
+          worker->stats.n_directories++;
+
+          if (pool_can_push (worker->pool) ||
+              worker->inline_depth < GS_POOL_MAX_INLINE_DEPTH)
+            {
+              GsDuTask *task = g_new0 (GsDuTask, 1);
+              GError *local_error = NULL;
+
+              task->base.run = du_task_run;
+              task->base.destroy = (GDestroyNotify) du_task_free;
+              task->ctx = ctx;
+              if (!gs_dirfd_iterator_init_at (iter->fd, dent->d_name, FALSE,
+                                              &task->iter, &local_error))
+                {
+                  du_task_free (task);
+                  /* Deleted since it was listed */
+                  if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+                    {
+                      g_clear_error (&local_error);
+                      continue;
+                    }
+                  g_propagate_error (error, local_error);
+                  return FALSE;
+                }
+
+              if (pool_can_push (worker->pool))
+                pool_push (worker, &task->base);
+              else
+                {
+                  gboolean child_ok;
+
+                  worker->inline_depth++;
+                  child_ok = du_dir (&task->iter, ctx, worker, cancellable, error);
+                  worker->inline_depth--;
+                  du_task_free (task);
+                  if (!child_ok)
+                    return FALSE;
+                }
+            }
+          else
+            {
+              GError *local_error = NULL;
+
+              if (!du_walk (iter->fd, dent->d_name, ctx, worker, cancellable, &local_error))
+                {
+                  /* Deleted since it was listed; the walker already
+                   * skips anything below it that goes away.
+                   */
+                  if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+                    g_clear_error (&local_error);
+                  else
+                    {
+                      g_propagate_error (error, local_error);
+                      return FALSE;
+                    }
+                }
+            }
+        }
+      else
+        worker->stats.n_files++;
+
+      pool_worker_flush_stats (worker, FALSE);
+    }
+
+  return TRUE;
+}
+
+static gboolean
+du_task_run (GsPoolTask    *base,
+             GsPoolWorker  *worker,
+             GCancellable  *cancellable,
+             GError       **error)
+{
+  GsDuTask *task = (GsDuTask *) base;
+  return du_dir (&task->iter, task->ctx, worker, cancellable, error);
+}
+
+/**
+ * gs_shutil_du_at:
+ * @dfd: Directory file descriptor, or -1 for the current directory
+ * @path: A file or directory, relative to @dfd
+ * @n_workers: Number of threads, or 0 for one per CPU
+ * @progress: (allow-none): Where to report progress
+ * @out_usage: (out): Totals
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Measure the disk usage of @path, like du(1).  Directories are
+ * listed and their entries stat'ed by @n_workers threads at once,
+ * which on storage that can service many metadata requests at once
+ * makes a large tree much faster to measure.  Symbolic links are not
+ * followed, including @path itself; mount points are crossed.
+ *
+ * Entries below @path that are removed while it is measured are
+ * skipped, along with anything below them, rather than failing with
+ * %G_IO_ERROR_NOT_FOUND.
+ *
+ * Returns: %TRUE on success
+ */
+gboolean
+gs_shutil_du_at (int                  dfd,
+                 const char          *path,
+                 guint                n_workers,
+                 GSShutilProgress    *progress,
+                 GSShutilDiskUsage   *out_usage,
+                 GCancellable        *cancellable,
+                 GError             **error)
+{
+  gboolean ret = FALSE;
+  GsDuContext ctx = { 0, };
+  GSShutilDiskUsage root_usage = { 0, };
+  GSStat st;
+  guint i;
+
+  if (n_workers == 0)
+    {
+      long n_cpus = sysconf (_SC_NPROCESSORS_ONLN);
+      n_workers = n_cpus > 0 ? (guint) n_cpus : 1;
+    }
+
+  if (dfd == -1)
+    dfd = AT_FDCWD;
+
+  g_mutex_init (&ctx.inodes_lock);
+  ctx.inodes = g_hash_table_new_full (cp_inode_hash, cp_inode_equal, g_free, NULL);
+  ctx.usage = g_new0 (GSShutilDiskUsage, n_workers);
+
+  progress_set_phase (progress, GS_SHUTIL_PHASE_DISK_USAGE);
 
-  if (!gs_file_get_all_xattrs (src, &src_xattrs, cancellable, error))
+  if (!gs_stat_at (dfd, path, AT_SYMLINK_NOFOLLOW, GS_DU_STAT_MASK, &st, error))
     goto out;
+  du_account (&ctx, &root_usage, &st);
 
-  if (src_xattrs)
+  if (S_ISDIR (st.mode))
     {
-      if (!gs_fd_set_all_xattrs (dest_fd, src_xattrs, cancellable, error))
+      GsDuTask *root = g_new0 (GsDuTask, 1);
+
+      root->base.run = du_task_run;
+      root->base.destroy = (GDestroyNotify) du_task_free;
+      root->ctx = &ctx;
+      if (!gs_dirfd_iterator_init_at (dfd, path, FALSE, &root->iter, error))
+        {
+          du_task_free (root);
+          goto out;
+        }
+      if (!pool_run (&root->base, "gs-du-worker", n_workers, progress,
+                     cancellable, error))
         goto out;
     }
 
+  for (i = 0; i < n_workers; i++)
+    {
+      root_usage.n_directories += ctx.usage[i].n_directories;
+      root_usage.n_files += ctx.usage[i].n_files;
+      root_usage.n_inodes += ctx.usage[i].n_inodes;
+      root_usage.apparent_bytes += ctx.usage[i].apparent_bytes;
+      root_usage.allocated_bytes += ctx.usage[i].allocated_bytes;
+      root_usage.unique_apparent_bytes += ctx.usage[i].unique_apparent_bytes;
+      root_usage.unique_allocated_bytes += ctx.usage[i].unique_allocated_bytes;
+    }
+  *out_usage = root_usage;
+
   ret = TRUE;
  out:
-  g_clear_pointer (&src_xattrs, g_variant_unref);
+  progress_set_phase (progress, -1);
+  g_free (ctx.usage);
+  g_hash_table_unref (ctx.inodes);
+  g_mutex_clear (&ctx.inodes_lock);
   return ret;
 }
 
+/**
+ * gs_shutil_du:
+ * @path: A file or directory
+ * @n_workers: Number of threads, or 0 for one per CPU
+ * @progress: (allow-none): Where to report progress
+ * @out_usage: (out): Totals
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Like gs_shutil_du_at(), for a #GFile.
+ *
+ * Returns: %TRUE on success
+ */
+gboolean
+gs_shutil_du (GFile               *path,
+              guint                n_workers,
+              GSShutilProgress    *progress,
+              GSShutilDiskUsage   *out_usage,
+              GCancellable        *cancellable,
+              GError             **error)
+{
+  return gs_shutil_du_at (-1, gs_file_get_path_cached (path), n_workers, progress,
+                          out_usage, cancellable, error);
+}
+
+/* Most of the asynchronous operations below run at once; more would
+ * mostly make the disks seek between them.
+ */
+#define GS_SHUTIL_ASYNC_MAX_JOBS 2
+
+/* How often asynchronous operations report progress */
+#define GS_SHUTIL_ASYNC_PROGRESS_MS 100
+
+/* From linux/ioprio.h, which is not always installed */
+#define GS_IOPRIO_WHO_PROCESS 1
+#define GS_IOPRIO_CLASS_IDLE 3
+#define GS_IOPRIO_CLASS_SHIFT 13
+
 typedef enum {
-  GS_CP_MODE_NONE,
-  GS_CP_MODE_HARDLINK,
-  GS_CP_MODE_COPY_ALL
-} GsCpMode;
+  GS_ASYNC_CP_A,
+  GS_ASYNC_CP_AL_OR_FALLBACK,
+  GS_ASYNC_RM_RF,
+  GS_ASYNC_RM_RF_BACKGROUND
+} GsAsyncOp;
+
+/* An asynchronous operation, queued on the shared pool.  Progress is
+ * coalesced into @stats by whichever thread runs it, and reported
+ * from an idle in @context; each pending idle holds a reference.
+ */
+typedef struct {
+  volatile gint ref_count;
+  GsAsyncOp op;
+  GFile *src;
+  GFile *dest;
+  int dfd;     /* GS_ASYNC_RM_RF_BACKGROUND */
+  char *path;  /* GS_ASYNC_RM_RF_BACKGROUND */
+  int io_priority;
+  guint serial;
+  GSimpleAsyncResult *result;
+  GCancellable *cancellable;
+
+  GMainContext *context;
+  GSShutilProgressFunc progress_func;
+  gpointer progress_data;
+  GSShutilProgress *progress;
+  GMutex lock;
+  GSShutilStats stats;
+  gboolean report_pending;
+} GsAsyncJob;
+
+static void
+async_job_unref (GsAsyncJob *job)
+{
+  if (!g_atomic_int_dec_and_test (&job->ref_count))
+    return;
+
+  g_clear_object (&job->src);
+  g_clear_object (&job->dest);
+  if (job->op == GS_ASYNC_RM_RF_BACKGROUND && job->dfd != -1)
+    (void) close (job->dfd);
+  g_free (job->path);
+  g_clear_object (&job->result);
+  g_clear_object (&job->cancellable);
+  if (job->context)
+    g_main_context_unref (job->context);
+  if (job->progress)
+    gs_shutil_progress_free (job->progress);
+  g_mutex_clear (&job->lock);
+  g_free (job);
+}
 
 static gboolean
-cp_internal (GFile         *src,
-             GFile         *dest,
-             GsCpMode       mode,
-             GCancellable  *cancellable,
-             GError       **error)
+async_job_report_idle (gpointer data)
 {
-  gboolean ret = FALSE;
-  GFileEnumerator *enumerator = NULL;
-  GFileInfo *src_info = NULL;
-  GFile *dest_child = NULL;
-  int dest_dfd = -1;
-  int r;
+  GsAsyncJob *job = data;
+  GSShutilStats stats;
 
-  enumerator = g_file_enumerate_children (src, "standard::type,standard::name,unix::uid,unix::gid,unix::mode",
-                                          G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
-                                          cancellable, error);
-  if (!enumerator)
-    goto out;
+  g_mutex_lock (&job->lock);
+  stats = job->stats;
+  job->report_pending = FALSE;
+  g_mutex_unlock (&job->lock);
 
-  src_info = g_file_query_info (src, "standard::name,unix::mode,unix::uid,unix::gid," \
-                                "time::modified,time::modified-usec,time::access,time::access-usec",
-                                G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
-                                cancellable, error);
-  if (!src_info)
-    goto out;
+  job->progress_func (&stats, job->progress_data);
+  return FALSE;
+}
 
-  do
-    r = mkdir (gs_file_get_path_cached (dest), 0755);
-  while (G_UNLIKELY (r == -1 && errno == EINTR));
-  if (r == -1)
+/* Called from the threads doing the work */
+static void
+async_job_on_progress (const GSShutilStats *stats,
+                       gpointer             user_data)
+{
+  GsAsyncJob *job = user_data;
+  gboolean schedule;
+
+  g_mutex_lock (&job->lock);
+  job->stats = *stats;
+  schedule = !job->report_pending;
+  job->report_pending = TRUE;
+  g_mutex_unlock (&job->lock);
+
+  if (schedule)
     {
-      gs_set_error_from_errno (error, errno);
-      goto out;
+      GSource *idle = g_idle_source_new ();
+
+      /* Like the completion, so that the last report comes first */
+      g_source_set_priority (idle, G_PRIORITY_DEFAULT);
+      g_atomic_int_inc (&job->ref_count);
+      g_source_set_callback (idle, async_job_report_idle, job,
+                             (GDestroyNotify) async_job_unref);
+      g_source_attach (idle, job->context);
+      g_source_unref (idle);
     }
+}
 
-  if (mode != GS_CP_MODE_NONE)
+/* For threads that only run background work: make them yield the CPU
+ * and the disks to everything else.
+ */
+static void
+async_lower_thread_priority (void)
+{
+#ifdef __linux__
+  /* Both apply to the calling thread only */
+  (void) setpriority (PRIO_PROCESS, syscall (__NR_gettid), 19);
+#ifdef __NR_ioprio_set
+  (void) syscall (__NR_ioprio_set, GS_IOPRIO_WHO_PROCESS, 0,
+                  GS_IOPRIO_CLASS_IDLE << GS_IOPRIO_CLASS_SHIFT);
+#endif
+#endif
+}
+
+static void
+async_job_run (gpointer data,
+               gpointer user_data)
+{
+  GsAsyncJob *job = data;
+  GError *local_error = NULL;
+  gboolean ok = FALSE;
+
+  /* It may have been cancelled while queued */
+  if (g_cancellable_set_error_if_cancelled (job->cancellable, &local_error))
+    goto out;
+
+  switch (job->op)
     {
-      if (!gs_file_open_dir_fd (dest, &dest_dfd,
-                                cancellable, error))
-        goto out;
+    case GS_ASYNC_CP_A:
+      ok = cp_internal (job->src, job->dest, GS_CP_MODE_COPY_ALL, GS_SHUTIL_CP_NONE,
+                        -1, 1, job->progress, job->cancellable, &local_error);
+      break;
+    case GS_ASYNC_CP_AL_OR_FALLBACK:
+      ok = cp_internal (job->src, job->dest, GS_CP_MODE_HARDLINK, GS_SHUTIL_CP_NONE,
+                        -1, 1, job->progress, job->cancellable, &local_error);
+      break;
+    case GS_ASYNC_RM_RF:
+      ok = gs_shutil_rm_rf_at_parallel (-1, gs_file_get_path_cached (job->src), 1,
+                                        job->progress, job->cancellable, &local_error);
+      break;
+    case GS_ASYNC_RM_RF_BACKGROUND:
+      async_lower_thread_priority ();
+      ok = rm_walk (job->dfd, job->path, NULL, job->cancellable, &local_error);
+      break;
+    }
 
-      do
-        r = fchown (dest_dfd,
-                    g_file_info_get_attribute_uint32 (src_info, "unix::uid"),
-                    g_file_info_get_attribute_uint32 (src_info, "unix::gid"));
-      while (G_UNLIKELY (r == -1 && errno == EINTR));
-      if (r == -1)
-        {
-          gs_set_error_from_errno (error, errno);
-          goto out;
-        }
+ out:
+  if (!ok)
+    g_simple_async_result_take_error (job->result, local_error);
+  g_simple_async_result_complete_in_idle (job->result);
+  async_job_unref (job);
+}
 
-      do
-        r = fchmod (dest_dfd, g_file_info_get_attribute_uint32 (src_info, "unix::mode"));
-      while (G_UNLIKELY (r == -1 && errno == EINTR));
+/* Lower io_priority values first, then in the order queued */
+static gint
+async_job_compare (gconstpointer a,
+                   gconstpointer b,
+                   gpointer      user_data)
+{
+  const GsAsyncJob *job_a = a;
+  const GsAsyncJob *job_b = b;
 
-      {
-        GError *temp_error = NULL;
-        if (!copy_xattrs_from_file_to_fd (src, dest_dfd, cancellable, &temp_error))
-          {
-            if (g_error_matches (temp_error, G_IO_ERROR, G_IO_ERROR_PERMISSION_DENIED) ||
-                g_error_matches (temp_error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED))
-              {
-                g_clear_error (&temp_error);
-              }
-            else
-              {
-                g_propagate_error (error, temp_error);
-                goto out;
-              }
-          }
-      }
+  if (job_a->io_priority != job_b->io_priority)
+    return job_a->io_priority < job_b->io_priority ? -1 : 1;
+  return job_a->serial < job_b->serial ? -1 : (job_a->serial > job_b->serial);
+}
 
-      if (dest_dfd != -1)
-        {
-          (void) close (dest_dfd);
-          dest_dfd = -1;
-        }
+static GThreadPool *
+async_get_pool (void)
+{
+  static gsize pool = 0;
+
+  if (g_once_init_enter (&pool))
+    {
+      GThreadPool *new_pool = g_thread_pool_new (async_job_run, NULL,
+                                                 GS_SHUTIL_ASYNC_MAX_JOBS, FALSE, NULL);
+      g_thread_pool_set_sort_function (new_pool, async_job_compare, NULL);
+      g_once_init_leave (&pool, (gsize) new_pool);
     }
 
-  while (TRUE)
+  return (GThreadPool *) pool;
+}
+
+/* Background deletes get a thread of their own, so that lowering its
+ * priority affects nothing else.
+ */
+static GThreadPool *
+async_get_background_pool (void)
+{
+  static gsize pool = 0;
+
+  if (g_once_init_enter (&pool))
     {
-      GFileInfo *file_info = NULL;
-      GFile *src_child = NULL;
+      GThreadPool *new_pool = g_thread_pool_new (async_job_run, NULL, 1, TRUE, NULL);
+      g_once_init_leave (&pool, (gsize) new_pool);
+    }
 
-      if (!gs_file_enumerator_iterate (enumerator, &file_info, &src_child,
-                                       cancellable, error))
-        goto out;
-      if (!file_info)
-        break;
+  return (GThreadPool *) pool;
+}
 
-      if (dest_child) g_object_unref (dest_child);
-      dest_child = g_file_get_child (dest, g_file_info_get_name (file_info));
+static void
+async_job_init (GsAsyncJob           *job,
+                GAsyncReadyCallback   callback,
+                gpointer              user_data,
+                gpointer              source_tag)
+{
+  static volatile gint next_serial = 0;
 
-      if (g_file_info_get_file_type (file_info) == G_FILE_TYPE_DIRECTORY)
-        {
-          if (!cp_internal (src_child, dest_child, mode,
-                            cancellable, error))
-            goto out;
-        }
-      else
-        {
-          gboolean did_link = FALSE;
-          (void) unlink (gs_file_get_path_cached (dest_child));
-          if (mode == GS_CP_MODE_HARDLINK)
-            {
-              if (link (gs_file_get_path_cached (src_child), gs_file_get_path_cached (dest_child)) == -1)
-                {
-                  if (!(errno == EMLINK || errno == EXDEV || errno == EPERM))
-                    {
-                      gs_set_error_from_errno (error, errno);
-                      goto out;
-                    }
-                  /* We failed to hardlink; fall back to copying all; this will
-                   * affect subsequent directory copies too.
-                   */
-                  mode = GS_CP_MODE_COPY_ALL;
-                }
-              else
-                did_link = TRUE;
-            }
-          if (!did_link)
-            {
-              GFileCopyFlags copyflags = G_FILE_COPY_OVERWRITE | G_FILE_COPY_NOFOLLOW_SYMLINKS;
-              if (mode == GS_CP_MODE_COPY_ALL)
-                copyflags |= G_FILE_COPY_ALL_METADATA;
-              if (!g_file_copy (src_child, dest_child, copyflags,
-                                cancellable, NULL, NULL, error))
-                goto out;
-            }
-        }
+  job->ref_count = 1;
+  job->serial = (guint) g_atomic_int_add (&next_serial, 1);
+  job->result = g_simple_async_result_new (NULL, callback, user_data, source_tag);
+  g_mutex_init (&job->lock);
+  if (job->progress_func)
+    {
+      job->context = g_main_context_ref_thread_default ();
+      job->progress = gs_shutil_progress_new (GS_SHUTIL_ASYNC_PROGRESS_MS,
+                                              async_job_on_progress, job);
     }
+}
 
-  ret = TRUE;
- out:
-  if (dest_dfd != -1)
-    (void) close (dest_dfd);
-  g_clear_object (&src_info);
-  g_clear_object (&enumerator);
-  g_clear_object (&dest_child);
-  return ret;
+static void
+async_job_start (GsAsyncJob           *job,
+                 GAsyncReadyCallback   callback,
+                 gpointer              user_data,
+                 gpointer              source_tag)
+{
+  async_job_init (job, callback, user_data, source_tag);
+  g_thread_pool_push (async_get_pool (), job, NULL);
+}
+
+static gboolean
+async_finish (GAsyncResult  *result,
+              gpointer       source_tag,
+              GError       **error)
+{
+  g_return_val_if_fail (g_simple_async_result_is_valid (result, NULL, source_tag), FALSE);
+
+  return !g_simple_async_result_propagate_error (G_SIMPLE_ASYNC_RESULT (result), error);
 }
 
 /**
- * gs_shutil_cp_al_or_fallback:
+ * gs_shutil_cp_a_async:
  * @src: Source path
  * @dest: Destination path
- * @cancellable:
- * @error:
+ * @io_priority: The I/O priority of the request
+ * @progress_func: (allow-none): Called with progress in the thread-default main context
+ * @progress_data: User data for @progress_func
+ * @cancellable: Cancellable
+ * @callback: Called when the copy is done
+ * @user_data: User data for @callback
  *
- * Recursively copy path @src (which must be a directory) to the
- * target @dest.  If possible, hardlinks are used; if a hardlink is
- * not possible, a regular copy is created.  Any existing files are
- * overwritten.
+ * Asynchronous version of gs_shutil_cp_a().  The copy is queued on a
+ * pool shared by all asynchronous operations here, which runs only a
+ * couple at once, lowest @io_priority first.  Cancelling stops the
+ * copy at the next file, leaving what was already copied.
+ */
+void
+gs_shutil_cp_a_async (GFile                *src,
+                      GFile                *dest,
+                      int                   io_priority,
+                      GSShutilProgressFunc  progress_func,
+                      gpointer              progress_data,
+                      GCancellable         *cancellable,
+                      GAsyncReadyCallback   callback,
+                      gpointer              user_data)
+{
+  GsAsyncJob *job = g_new0 (GsAsyncJob, 1);
+
+  job->op = GS_ASYNC_CP_A;
+  job->src = g_object_ref (src);
+  job->dest = g_object_ref (dest);
+  job->io_priority = io_priority;
+  job->progress_func = progress_func;
+  job->progress_data = progress_data;
+  job->cancellable = cancellable ? g_object_ref (cancellable) : NULL;
+  async_job_start (job, callback, user_data, gs_shutil_cp_a_async);
+}
+
+/**
+ * gs_shutil_cp_a_finish:
+ * @result: A #GAsyncResult
+ * @error: Error
+ *
+ * Finish gs_shutil_cp_a_async().
  *
  * Returns: %TRUE on success
  */
 gboolean
-gs_shutil_cp_al_or_fallback (GFile         *src,
-                             GFile         *dest,
-                             GCancellable  *cancellable,
-                             GError       **error)
+gs_shutil_cp_a_finish (GAsyncResult  *result,
+                       GError       **error)
 {
-  return cp_internal (src, dest, GS_CP_MODE_HARDLINK,
-                      cancellable, error);
+  return async_finish (result, gs_shutil_cp_a_async, error);
 }
 
 /**
- * gs_shutil_cp_a:
+ * gs_shutil_cp_al_or_fallback_async:
  * @src: Source path
  * @dest: Destination path
- * @cancellable:
- * @error:
+ * @io_priority: The I/O priority of the request
+ * @progress_func: (allow-none): Called with progress in the thread-default main context
+ * @progress_data: User data for @progress_func
+ * @cancellable: Cancellable
+ * @callback: Called when the copy is done
+ * @user_data: User data for @callback
  *
- * Recursively copy path @src (which must be a directory) to the
- * target @dest.  Any existing files are overwritten.
+ * Asynchronous version of gs_shutil_cp_al_or_fallback(); see
+ * gs_shutil_cp_a_async().
+ */
+void
+gs_shutil_cp_al_or_fallback_async (GFile                *src,
+                                   GFile                *dest,
+                                   int                   io_priority,
+                                   GSShutilProgressFunc  progress_func,
+                                   gpointer              progress_data,
+                                   GCancellable         *cancellable,
+                                   GAsyncReadyCallback   callback,
+                                   gpointer              user_data)
+{
+  GsAsyncJob *job = g_new0 (GsAsyncJob, 1);
+
+  job->op = GS_ASYNC_CP_AL_OR_FALLBACK;
+  job->src = g_object_ref (src);
+  job->dest = g_object_ref (dest);
+  job->io_priority = io_priority;
+  job->progress_func = progress_func;
+  job->progress_data = progress_data;
+  job->cancellable = cancellable ? g_object_ref (cancellable) : NULL;
+  async_job_start (job, callback, user_data, gs_shutil_cp_al_or_fallback_async);
+}
+
+/**
+ * gs_shutil_cp_al_or_fallback_finish:
+ * @result: A #GAsyncResult
+ * @error: Error
+ *
+ * Finish gs_shutil_cp_al_or_fallback_async().
  *
  * Returns: %TRUE on success
  */
 gboolean
-gs_shutil_cp_a (GFile         *src,
-                GFile         *dest,
-                GCancellable  *cancellable,
-                GError       **error)
+gs_shutil_cp_al_or_fallback_finish (GAsyncResult  *result,
+                                    GError       **error)
 {
-  return cp_internal (src, dest, GS_CP_MODE_COPY_ALL,
-                      cancellable, error);
+  return async_finish (result, gs_shutil_cp_al_or_fallback_async, error);
 }
 
 /**
- * gs_shutil_rm_rf_at:
+ * gs_shutil_rm_rf_async:
+ * @path: A file or directory
+ * @io_priority: The I/O priority of the request
+ * @progress_func: (allow-none): Called with progress in the thread-default main context
+ * @progress_data: User data for @progress_func
+ * @cancellable: Cancellable
+ * @callback: Called when the deletion is done
+ * @user_data: User data for @callback
+ *
+ * Asynchronous version of gs_shutil_rm_rf(); see
+ * gs_shutil_cp_a_async().
+ */
+void
+gs_shutil_rm_rf_async (GFile                *path,
+                       int                   io_priority,
+                       GSShutilProgressFunc  progress_func,
+                       gpointer              progress_data,
+                       GCancellable         *cancellable,
+                       GAsyncReadyCallback   callback,
+                       gpointer              user_data)
+{
+  GsAsyncJob *job = g_new0 (GsAsyncJob, 1);
+
+  job->op = GS_ASYNC_RM_RF;
+  job->src = g_object_ref (path);
+  job->io_priority = io_priority;
+  job->progress_func = progress_func;
+  job->progress_data = progress_data;
+  job->cancellable = cancellable ? g_object_ref (cancellable) : NULL;
+  async_job_start (job, callback, user_data, gs_shutil_rm_rf_async);
+}
+
+/**
+ * gs_shutil_rm_rf_finish:
+ * @result: A #GAsyncResult
+ * @error: Error
+ *
+ * Finish gs_shutil_rm_rf_async().
+ *
+ * Returns: %TRUE on success
+ */
+gboolean
+gs_shutil_rm_rf_finish (GAsyncResult  *result,
+                        GError       **error)
+{
+  return async_finish (result, gs_shutil_rm_rf_async, error);
+}
+
+/**
+ * gs_shutil_swap_trees:
  * @dfd: A directory file descriptor, or -1 for current
- * @path: Path
+ * @a: A path
+ * @b: Another path
  * @cancellable: Cancellable
  * @error: Error
  *
- * Recursively delete the filename referenced by the combination of
- * the directory fd@dfd and @path; it may be a file or directory.  No
- * error is thrown if @path does not exist.
+ * Exchange @a and @b, which must both exist and be on the same
+ * filesystem, in a single step with gs_renameat() and
+ * %GS_RENAME_EXCHANGE.  Unlike renaming the new tree into place after
+ * moving the old one away, there is no moment at which either path is
+ * missing, and readers of @a see either all of the old tree or all of
+ * the new one.  Typically @b is then deleted with
+ * gs_shutil_rm_rf_at_background().
+ *
+ * Fails with %G_IO_ERROR_NOT_SUPPORTED where the kernel or filesystem
+ * cannot exchange paths.
+ *
+ * Returns: %TRUE on success
  */
 gboolean
-gs_shutil_rm_rf_at (int           dfd,
-                    const char   *path,
-                    GCancellable *cancellable,
-                    GError      **error)
+gs_shutil_swap_trees (int            dfd,
+                      const char    *a,
+                      const char    *b,
+                      GCancellable  *cancellable,
+                      GError       **error)
+{
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return FALSE;
+
+  return gs_renameat (dfd, a, dfd, b, GS_RENAME_EXCHANGE, error);
+}
+
+/* Rename @path in @dfd to a new temporary name in the same directory,
+ * returning that directory and the new name.  If @path does not exist,
+ * @out_name is %NULL.
+ */
+static gboolean
+rm_background_detach (int            dfd,
+                      const char    *path,
+                      int           *out_dfd,
+                      char         **out_name,
+                      GError       **error)
 {
-  return glnx_shutil_rm_rf_at (dfd, path, cancellable, error);
+  gboolean ret = FALSE;
+  char *dir = g_path_get_dirname (path);
+  char *name = g_path_get_basename (path);
+  char tmp_name[GS_FILEUTIL_TMP_NAME_MAX];
+  int dir_fd = -1;
+
+  if (dfd == -1)
+    dfd = AT_FDCWD;
+
+  dir_fd = gs_opendirat_with_errno (dfd, dir, TRUE);
+  if (dir_fd == -1)
+    {
+      if (errno != ENOENT)
+        {
+          gs_set_prefix_error_from_errno (error, errno, "openat");
+          goto out;
+        }
+      ret = TRUE;
+      *out_name = NULL;
+      goto out;
+    }
+
+  while (TRUE)
+    {
+      (void) gs_fileutil_gen_tmp_name_buf (NULL, "deleting", tmp_name, sizeof (tmp_name));
+
+      if (gs_renameat_with_errno (dir_fd, name, dir_fd, tmp_name, GS_RENAME_NOREPLACE) == 0)
+        {
+          *out_name = g_strdup (tmp_name);
+          break;
+        }
+      if (errno == ENOENT)
+        {
+          *out_name = NULL;
+          break;
+        }
+      if (errno != EEXIST)
+        {
+          gs_set_prefix_error_from_errno (error, errno, "renameat");
+          goto out;
+        }
+    }
+
+  ret = TRUE;
+  *out_dfd = dir_fd;
+  dir_fd = -1;
+ out:
+  if (dir_fd != -1)
+    (void) close (dir_fd);
+  g_free (dir);
+  g_free (name);
+  return ret;
 }
 
 /**
- * gs_shutil_rm_rf:
+ * gs_shutil_rm_rf_at_background:
+ * @dfd: A directory file descriptor, or -1 for current
  * @path: A file or directory
- * @cancellable:
- * @error:
+ * @cancellable: Cancellable
+ * @callback: (allow-none): Called when the deletion is done
+ * @user_data: User data for @callback
  *
- * Recursively delete the filename referenced by @path; it may be a
- * file or directory.  No error is thrown if @path does not exist.
+ * Delete @path in the background.  @path is first renamed to a
+ * temporary name in the same directory, so that it is free for reuse
+ * as soon as this returns; what it named is then deleted like
+ * gs_shutil_rm_rf_at() by a thread of its own, running at the lowest
+ * CPU and I/O priority, so that it competes as little as possible with
+ * the rest of the program.  Background deletions run one at a time.
+ * No error is thrown if @path does not exist.
+ *
+ * If cancelled, the temporary name is left behind, with whatever was
+ * not deleted yet.
  */
-gboolean
-gs_shutil_rm_rf (GFile        *path,
-                 GCancellable *cancellable,
-                 GError      **error)
+void
+gs_shutil_rm_rf_at_background (int                   dfd,
+                               const char           *path,
+                               GCancellable         *cancellable,
+                               GAsyncReadyCallback   callback,
+                               gpointer              user_data)
 {
-  return gs_shutil_rm_rf_at (-1, gs_file_get_path_cached (path), cancellable, error);
+  GsAsyncJob *job = g_new0 (GsAsyncJob, 1);
+  GError *local_error = NULL;
+
+  job->op = GS_ASYNC_RM_RF_BACKGROUND;
+  job->dfd = -1;
+  job->cancellable = cancellable ? g_object_ref (cancellable) : NULL;
+  async_job_init (job, callback, user_data, gs_shutil_rm_rf_at_background);
+
+  if (!rm_background_detach (dfd, path, &job->dfd, &job->path, &local_error))
+    g_simple_async_result_take_error (job->result, local_error);
+  else if (job->path != NULL)
+    {
+      g_thread_pool_push (async_get_background_pool (), job, NULL);
+      return;
+    }
+
+  g_simple_async_result_complete_in_idle (job->result);
+  async_job_unref (job);
 }
 
+/**
+ * gs_shutil_rm_rf_at_background_finish:
+ * @result: A #GAsyncResult
+ * @error: Error
+ *
+ * Finish gs_shutil_rm_rf_at_background().
+ *
+ * Returns: %TRUE on success
+ */
+gboolean
+gs_shutil_rm_rf_at_background_finish (GAsyncResult  *result,
+                                      GError       **error)
+{
+  return async_finish (result, gs_shutil_rm_rf_at_background, error);
+}
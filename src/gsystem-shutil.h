@@ -22,32 +22,340 @@
 #define __GSYSTEM_SHUTIL_H__
 
 #include <gio/gio.h>
+#include "gsystem-file-utils.h"
 
 G_BEGIN_DECLS
 
+/**
+ * GSShutilCpFlags:
+ * @GS_SHUTIL_CP_NONE: No flags
+ * @GS_SHUTIL_CP_HARDLINK: Hardlink files where possible, falling back to copies
+ * @GS_SHUTIL_CP_SYNC: Update an existing destination, skipping files which are
+ *   already up to date and deleting those not in the source
+ * @GS_SHUTIL_CP_SYNC_CHECKSUM: With %GS_SHUTIL_CP_SYNC, also compare file contents
+ * @GS_SHUTIL_CP_DURABLE: Ensure the copy is on stable storage before returning
+ */
+typedef enum {
+  GS_SHUTIL_CP_NONE = 0,
+  GS_SHUTIL_CP_HARDLINK = (1 << 0),
+  GS_SHUTIL_CP_SYNC = (1 << 1),
+  GS_SHUTIL_CP_SYNC_CHECKSUM = (1 << 2),
+  GS_SHUTIL_CP_DURABLE = (1 << 3)
+} GSShutilCpFlags;
+
+/**
+ * GSShutilDiffFlags:
+ * @GS_SHUTIL_DIFF_NONE: Regular files of the same size and modification time are the same
+ * @GS_SHUTIL_DIFF_CONTENTS: Regular files of the same size are compared by contents instead
+ */
+typedef enum {
+  GS_SHUTIL_DIFF_NONE = 0,
+  GS_SHUTIL_DIFF_CONTENTS = (1 << 0)
+} GSShutilDiffFlags;
+
+/**
+ * GSShutilDiffKind:
+ * @GS_SHUTIL_DIFF_ADDED: Only in the second tree
+ * @GS_SHUTIL_DIFF_REMOVED: Only in the first tree
+ * @GS_SHUTIL_DIFF_MODIFIED: In both, but different
+ */
+typedef enum {
+  GS_SHUTIL_DIFF_ADDED,
+  GS_SHUTIL_DIFF_REMOVED,
+  GS_SHUTIL_DIFF_MODIFIED
+} GSShutilDiffKind;
+
+/**
+ * GSShutilDiffFunc:
+ * @kind: How the entry differs
+ * @path: Path of the entry, relative to the roots of the trees
+ * @user_data: User data
+ *
+ * Called by gs_shutil_diff_at() for each difference.
+ */
+typedef void (*GSShutilDiffFunc) (GSShutilDiffKind  kind,
+                                  const char       *path,
+                                  gpointer          user_data);
+
+/**
+ * GSShutilChecksumFlags:
+ * @GS_SHUTIL_CHECKSUM_NONE: Cover names, file types and contents only
+ * @GS_SHUTIL_CHECKSUM_METADATA: Also cover modes, ownership and device numbers
+ * @GS_SHUTIL_CHECKSUM_XATTRS: Also cover extended attributes
+ */
+typedef enum {
+  GS_SHUTIL_CHECKSUM_NONE = 0,
+  GS_SHUTIL_CHECKSUM_METADATA = (1 << 0),
+  GS_SHUTIL_CHECKSUM_XATTRS = (1 << 1)
+} GSShutilChecksumFlags;
+
+/**
+ * GSShutilPhase:
+ * @GS_SHUTIL_PHASE_COPY: Walking and copying a tree
+ * @GS_SHUTIL_PHASE_DELETE: Deleting a tree
+ * @GS_SHUTIL_PHASE_SYNC: Flushing to stable storage
+ * @GS_SHUTIL_PHASE_CHECKSUM: Walking and checksumming a tree
+ * @GS_SHUTIL_PHASE_DISK_USAGE: Walking a tree to measure it
+ * @GS_SHUTIL_N_PHASES: Number of phases
+ */
+typedef enum {
+  GS_SHUTIL_PHASE_COPY,
+  GS_SHUTIL_PHASE_DELETE,
+  GS_SHUTIL_PHASE_SYNC,
+  GS_SHUTIL_PHASE_CHECKSUM,
+  GS_SHUTIL_PHASE_DISK_USAGE,
+  GS_SHUTIL_N_PHASES
+} GSShutilPhase;
+
+/**
+ * GSShutilStats:
+ * @n_directories: Directories created, removed, checksummed or measured
+ * @n_files: Other entries handled, however that was done
+ * @n_hardlinked: Files hardlinked rather than copied
+ * @n_copied: Files copied
+ * @n_skipped: Files already up to date, with %GS_SHUTIL_CP_SYNC
+ * @n_deleted: Entries deleted
+ * @n_bytes: Bytes of file data copied, or read to checksum
+ * @data_usec: Time spent on file data, summed over all threads
+ * @phase_usec: Wall-clock time spent in each #GSShutilPhase
+ *
+ * Running totals for an operation.  Comparing @data_usec with the
+ * time of %GS_SHUTIL_PHASE_COPY (times the number of threads) shows
+ * whether a copy is limited by data or by metadata.
+ */
+typedef struct {
+  guint64 n_directories;
+  guint64 n_files;
+  guint64 n_hardlinked;
+  guint64 n_copied;
+  guint64 n_skipped;
+  guint64 n_deleted;
+  guint64 n_bytes;
+  gint64 data_usec;
+  gint64 phase_usec[GS_SHUTIL_N_PHASES];
+} GSShutilStats;
+
+typedef struct _GSShutilProgress GSShutilProgress;
+
+/**
+ * GSShutilDiskUsage:
+ * @n_directories: Directories, including the root
+ * @n_files: Other entries, counting each hardlink
+ * @n_inodes: Distinct inodes, counting hardlinks within the tree once
+ * @apparent_bytes: Sum of the sizes of all entries
+ * @allocated_bytes: Sum of the storage allocated to all entries
+ * @unique_apparent_bytes: Like @apparent_bytes, counting each inode once
+ * @unique_allocated_bytes: Like @allocated_bytes, counting each inode
+ *   once; this is what du(1) reports
+ *
+ * Totals computed by gs_shutil_du_at().
+ */
+typedef struct {
+  guint64 n_directories;
+  guint64 n_files;
+  guint64 n_inodes;
+  guint64 apparent_bytes;
+  guint64 allocated_bytes;
+  guint64 unique_apparent_bytes;
+  guint64 unique_allocated_bytes;
+} GSShutilDiskUsage;
+
+/**
+ * GSShutilProgressFunc:
+ * @stats: Totals so far
+ * @user_data: User data
+ *
+ * Called with the totals of an operation at most once per the
+ * interval given to gs_shutil_progress_new(), and once more at the
+ * end.  It may be called from any thread, though never from two at
+ * once, and should return quickly.
+ */
+typedef void (*GSShutilProgressFunc) (const GSShutilStats *stats,
+                                      gpointer             user_data);
+
+GSShutilProgress *
+gs_shutil_progress_new (guint                 interval_ms,
+                        GSShutilProgressFunc  func,
+                        gpointer              user_data);
+
+void
+gs_shutil_progress_free (GSShutilProgress *progress);
+
+void
+gs_shutil_progress_get_stats (GSShutilProgress *progress,
+                              GSShutilStats    *out_stats);
+
 gboolean
 gs_shutil_cp_al_or_fallback (GFile         *src,
                              GFile         *dest,
                              GCancellable  *cancellable,
                              GError       **error);
 
+gboolean
+gs_shutil_cp_al_dedup (GFile         *src,
+                       GFile         *dest,
+                       GFile         *store,
+                       GCancellable  *cancellable,
+                       GError       **error);
+
 gboolean
 gs_shutil_cp_a (GFile         *src,
                 GFile         *dest,
                 GCancellable  *cancellable,
                 GError       **error);
 
+gboolean
+gs_shutil_cp_a_parallel (GFile            *src,
+                         GFile            *dest,
+                         GSShutilCpFlags   flags,
+                         guint             n_workers,
+                         GSShutilProgress *progress,
+                         GCancellable     *cancellable,
+                         GError          **error);
+
+gboolean
+gs_shutil_diff_at (int                 a_dfd,
+                   const char         *a_path,
+                   int                 b_dfd,
+                   const char         *b_path,
+                   GSShutilDiffFlags   flags,
+                   GSShutilDiffFunc    func,
+                   gpointer            user_data,
+                   GCancellable       *cancellable,
+                   GError            **error);
+
+gboolean
+gs_shutil_diff (GFile              *a,
+                GFile              *b,
+                GSShutilDiffFlags   flags,
+                GSShutilDiffFunc    func,
+                gpointer            user_data,
+                GCancellable       *cancellable,
+                GError            **error);
+
+gboolean
+gs_shutil_mv_at (int             old_dfd,
+                 const char     *old_path,
+                 int             new_dfd,
+                 const char     *new_path,
+                 GSRenameFlags   flags,
+                 GCancellable   *cancellable,
+                 GError        **error);
+
+gboolean
+gs_shutil_mv (GFile          *src,
+              GFile          *dest,
+              GSRenameFlags   flags,
+              GCancellable   *cancellable,
+              GError        **error);
+
 gboolean
 gs_shutil_rm_rf_at (int            dfd,
                     const char    *path,
                     GCancellable  *cancellable,
                     GError       **error);
 
+gboolean
+gs_shutil_rm_rf_at_parallel (int                dfd,
+                             const char        *path,
+                             guint              n_workers,
+                             GSShutilProgress  *progress,
+                             GCancellable      *cancellable,
+                             GError           **error);
+
+gboolean
+gs_shutil_checksum_tree_at (int                     dfd,
+                            const char             *path,
+                            GChecksumType           checksum_type,
+                            GSShutilChecksumFlags   flags,
+                            guint                   n_workers,
+                            GSShutilProgress       *progress,
+                            GHashTable            **out_checksums,
+                            char                  **out_root_checksum,
+                            GCancellable           *cancellable,
+                            GError                **error);
+
+gboolean
+gs_shutil_du_at (int                  dfd,
+                 const char          *path,
+                 guint                n_workers,
+                 GSShutilProgress    *progress,
+                 GSShutilDiskUsage   *out_usage,
+                 GCancellable        *cancellable,
+                 GError             **error);
+
+gboolean
+gs_shutil_du (GFile               *path,
+              guint                n_workers,
+              GSShutilProgress    *progress,
+              GSShutilDiskUsage   *out_usage,
+              GCancellable        *cancellable,
+              GError             **error);
+
 gboolean
 gs_shutil_rm_rf (GFile        *path,
                  GCancellable *cancellable,
                  GError      **error);
 
+void
+gs_shutil_cp_a_async (GFile                *src,
+                      GFile                *dest,
+                      int                   io_priority,
+                      GSShutilProgressFunc  progress_func,
+                      gpointer              progress_data,
+                      GCancellable         *cancellable,
+                      GAsyncReadyCallback   callback,
+                      gpointer              user_data);
+
+gboolean
+gs_shutil_cp_a_finish (GAsyncResult  *result,
+                       GError       **error);
+
+void
+gs_shutil_cp_al_or_fallback_async (GFile                *src,
+                                   GFile                *dest,
+                                   int                   io_priority,
+                                   GSShutilProgressFunc  progress_func,
+                                   gpointer              progress_data,
+                                   GCancellable         *cancellable,
+                                   GAsyncReadyCallback   callback,
+                                   gpointer              user_data);
+
+gboolean
+gs_shutil_cp_al_or_fallback_finish (GAsyncResult  *result,
+                                    GError       **error);
+
+void
+gs_shutil_rm_rf_async (GFile                *path,
+                       int                   io_priority,
+                       GSShutilProgressFunc  progress_func,
+                       gpointer              progress_data,
+                       GCancellable         *cancellable,
+                       GAsyncReadyCallback   callback,
+                       gpointer              user_data);
+
+gboolean
+gs_shutil_rm_rf_finish (GAsyncResult  *result,
+                        GError       **error);
+
+gboolean
+gs_shutil_swap_trees (int            dfd,
+                      const char    *a,
+                      const char    *b,
+                      GCancellable  *cancellable,
+                      GError       **error);
+
+void
+gs_shutil_rm_rf_at_background (int                   dfd,
+                               const char           *path,
+                               GCancellable         *cancellable,
+                               GAsyncReadyCallback   callback,
+                               gpointer              user_data);
+
+gboolean
+gs_shutil_rm_rf_at_background_finish (GAsyncResult  *result,
+                                      GError       **error);
+
 G_END_DECLS
 
 #endif
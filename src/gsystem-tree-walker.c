@@ -0,0 +1,551 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2012 Colin Walters <walters@verbum.org>.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define _GSYSTEM_NO_LOCAL_ALLOC
+#include "libgsystem.h"
+
+#define GS_TREE_WALKER_DEFAULT_MAX_FDS 64
+
+struct _GSTreeWalker {
+  GSTreeWalkerFlags flags;
+  GSStatMask stat_mask;
+  guint max_fds;
+  gboolean skip;
+};
+
+/* A directory on the explicit stack of a walk.  While it is being
+ * listed, @iter is open; if its fd was needed elsewhere, the rest of
+ * its entries are in @pending instead, and @fd is reopened as a plain
+ * descriptor whenever it is needed again.
+ */
+typedef struct {
+  GSDirFdIterator iter;
+  int fd;                 /* iter.fd, a reopened fd, or -1 */
+  GPtrArray *pending;     /* Each a d_type byte, then the name */
+  guint next_pending;
+  gsize path_len;         /* Length of its path in GsTreeWalk.path */
+  gsize name_len;
+  GSStat stat;            /* Only with GS_STAT_INO once evicted */
+} GsTreeFrame;
+
+typedef struct {
+  GSTreeWalker *walker;
+  int root_dfd;
+  const char *root_path;
+  GArray *frames;
+  GString *path;
+  guint n_open;
+} GsTreeWalk;
+
+/**
+ * gs_tree_walker_new:
+ * @flags: Flags
+ * @stat_mask: Metadata to get for each entry, or 0
+ * @max_fds: Most directories to hold open at once, or 0 for a default
+ *
+ * Create a walker for gs_tree_walker_walk().  A walk keeps its state
+ * on an explicit stack rather than recursing, so the depth of a tree
+ * costs neither stack space nor, beyond @max_fds, file descriptors.
+ *
+ * If @stat_mask is nonzero, the #GSStat of each entry is passed to
+ * the callbacks, as with gs_stat_at().
+ *
+ * Returns: (transfer full): A new walker
+ */
+GSTreeWalker *
+gs_tree_walker_new (GSTreeWalkerFlags  flags,
+                    GSStatMask         stat_mask,
+                    guint              max_fds)
+{
+  GSTreeWalker *walker = g_new0 (GSTreeWalker, 1);
+  walker->flags = flags;
+  walker->stat_mask = stat_mask;
+  /* The directory being listed, and the one being opened below it */
+  walker->max_fds = max_fds ? MAX (max_fds, 2) : GS_TREE_WALKER_DEFAULT_MAX_FDS;
+  return walker;
+}
+
+/**
+ * gs_tree_walker_free:
+ * @walker: A walker
+ *
+ * Free @walker, which must not be walking.
+ */
+void
+gs_tree_walker_free (GSTreeWalker *walker)
+{
+  g_free (walker);
+}
+
+/**
+ * gs_tree_walker_skip_subtree:
+ * @walker: A walker
+ *
+ * When called from the pre-order callback of a directory, do not
+ * descend into it; its post-order callback is not called either.
+ */
+void
+gs_tree_walker_skip_subtree (GSTreeWalker *walker)
+{
+  walker->skip = TRUE;
+}
+
+static void
+tree_frame_close (GsTreeWalk  *walk,
+                  GsTreeFrame *frame)
+{
+  if (frame->iter.initialized)
+    {
+      gs_dirfd_iterator_clear (&frame->iter);
+      walk->n_open--;
+    }
+  else if (frame->fd != -1)
+    {
+      (void) close (frame->fd);
+      walk->n_open--;
+    }
+  frame->fd = -1;
+}
+
+/* Read the remaining entries of @frame into memory, and close it */
+static gboolean
+tree_frame_evict (GsTreeWalk    *walk,
+                  GsTreeFrame   *frame,
+                  GCancellable  *cancellable,
+                  GError       **error)
+{
+  if (frame->iter.initialized)
+    {
+      if (frame->pending == NULL)
+        frame->pending = g_ptr_array_new_with_free_func (g_free);
+
+      while (TRUE)
+        {
+          struct dirent *dent;
+          char *item;
+
+          if (!gs_dirfd_iterator_next_dent (&frame->iter, &dent, cancellable, error))
+            return FALSE;
+          if (!dent)
+            break;
+
+          item = g_malloc (strlen (dent->d_name) + 2);
+          item[0] = dent->d_type;
+          strcpy (item + 1, dent->d_name);
+          g_ptr_array_add (frame->pending, item);
+        }
+    }
+
+  /* Needed to recognize it when reopening */
+  if (!(frame->stat.mask & GS_STAT_INO))
+    {
+      struct stat stbuf;
+
+      if (fstat (frame->fd, &stbuf) != 0)
+        {
+          gs_set_prefix_error_from_errno (error, errno, "fstat");
+          return FALSE;
+        }
+      frame->stat.dev = stbuf.st_dev;
+      frame->stat.ino = stbuf.st_ino;
+      frame->stat.mask |= GS_STAT_INO;
+    }
+
+  tree_frame_close (walk, frame);
+  return TRUE;
+}
+
+/* Make sure frame @i has a file descriptor, if it was evicted.  It
+ * is reopened as ".." of @child_fd (its finished subdirectory) if
+ * given, which works at any depth; if that fails, or turns out to be
+ * a different directory, it is reopened by path from the root.
+ * Either way, the result must be the same directory as before (by
+ * device and inode); if it was moved or removed meanwhile, the walk
+ * fails, rather than continuing in an unrelated directory.
+ */
+static gboolean
+tree_frame_ensure_fd (GsTreeWalk  *walk,
+                      guint        i,
+                      int          child_fd,
+                      GError     **error)
+{
+  GsTreeFrame *frame = &g_array_index (walk->frames, GsTreeFrame, i);
+  gboolean follow = (walk->walker->flags & GS_TREE_WALKER_FLAGS_FOLLOW_ROOT) != 0;
+  GError *local_error = NULL;
+  struct stat stbuf;
+  char *rel_path;
+  char *path;
+  gboolean ret;
+  int fd;
+
+  if (frame->fd != -1)
+    return TRUE;
+
+  if (child_fd != -1)
+    {
+      do
+        fd = openat (child_fd, "..", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      while (G_UNLIKELY (fd == -1 && errno == EINTR));
+      if (fd != -1 && fstat (fd, &stbuf) == 0 &&
+          stbuf.st_dev == frame->stat.dev && stbuf.st_ino == frame->stat.ino)
+        {
+          frame->fd = fd;
+          walk->n_open++;
+          return TRUE;
+        }
+      if (fd != -1)
+        (void) close (fd);
+    }
+
+  rel_path = g_strndup (walk->path->str, frame->path_len);
+  if (*rel_path)
+    {
+      path = g_strconcat (walk->root_path, "/", rel_path, NULL);
+      follow = FALSE;
+    }
+  else
+    path = g_strdup (walk->root_path);
+
+  ret = FALSE;
+  if (!gs_opendirat (walk->root_dfd, path, follow, &fd, &local_error))
+    {
+      /* Not G_IO_ERROR_NOT_FOUND, which callers take as an entry
+       * deleted during the walk, and skip.
+       */
+      if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Directory %s moved during walk", path);
+          g_clear_error (&local_error);
+        }
+      else
+        g_propagate_error (error, local_error);
+      goto out;
+    }
+  if (fstat (fd, &stbuf) == -1)
+    {
+      gs_set_prefix_error_from_errno (error, errno, "fstat");
+      (void) close (fd);
+      goto out;
+    }
+  if (stbuf.st_dev != frame->stat.dev || stbuf.st_ino != frame->stat.ino)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Directory %s moved during walk", path);
+      (void) close (fd);
+      goto out;
+    }
+
+  frame->fd = fd;
+  walk->n_open++;
+  ret = TRUE;
+ out:
+  g_free (rel_path);
+  g_free (path);
+  return ret;
+}
+
+static gboolean
+tree_frame_next (GsTreeFrame   *frame,
+                 const char   **out_name,
+                 guint8        *out_type,
+                 GCancellable  *cancellable,
+                 GError       **error)
+{
+  *out_name = NULL;
+  *out_type = DT_UNKNOWN;
+
+  if (frame->iter.initialized)
+    {
+      struct dirent *dent;
+
+      if (!gs_dirfd_iterator_next_dent (&frame->iter, &dent, cancellable, error))
+        return FALSE;
+      if (dent)
+        {
+          *out_name = dent->d_name;
+          *out_type = dent->d_type;
+        }
+    }
+  else if (frame->pending && frame->next_pending < frame->pending->len)
+    {
+      const char *item = frame->pending->pdata[frame->next_pending++];
+      *out_type = item[0];
+      *out_name = item + 1;
+    }
+
+  return TRUE;
+}
+
+static void
+tree_frame_clear (GsTreeWalk  *walk,
+                  GsTreeFrame *frame)
+{
+  tree_frame_close (walk, frame);
+  if (frame->pending)
+    g_ptr_array_unref (frame->pending);
+}
+
+/* Call @pre_func for @entry, then if it is a directory to descend
+ * into, push a frame for it.
+ */
+static gboolean
+tree_walk_visit (GsTreeWalk               *walk,
+                 const GSTreeWalkerEntry  *entry,
+                 const GSStat             *stat,
+                 GSTreeWalkerFunc          pre_func,
+                 gpointer                  user_data,
+                 GCancellable             *cancellable,
+                 GError                  **error)
+{
+  GSTreeWalker *walker = walk->walker;
+  GsTreeFrame frame = { { 0, }, };
+  GError *local_error = NULL;
+  gboolean follow;
+
+  walker->skip = FALSE;
+  if (pre_func && !pre_func (walker, entry, user_data, error))
+    return FALSE;
+  if (entry->type != DT_DIR || walker->skip)
+    return TRUE;
+
+  /* Free up a descriptor from the shallowest open ancestor; the
+   * parent of @entry is needed to open it.
+   */
+  if (walk->n_open >= walker->max_fds)
+    {
+      guint i;
+
+      for (i = 0; i + 1 < walk->frames->len; i++)
+        {
+          GsTreeFrame *ancestor = &g_array_index (walk->frames, GsTreeFrame, i);
+
+          if (ancestor->fd == -1)
+            continue;
+          if (!tree_frame_evict (walk, ancestor, cancellable, error))
+            return FALSE;
+          break;
+        }
+    }
+
+  follow = (entry->depth == 0 && (walker->flags & GS_TREE_WALKER_FLAGS_FOLLOW_ROOT) != 0);
+  if (!gs_dirfd_iterator_init_at (entry->dfd, entry->name, follow, &frame.iter, &local_error))
+    {
+      /* Deleted since it was listed */
+      if (entry->depth > 0 &&
+          g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        {
+          g_clear_error (&local_error);
+          return TRUE;
+        }
+      g_propagate_error (error, local_error);
+      return FALSE;
+    }
+
+  frame.fd = frame.iter.fd;
+  frame.path_len = walk->path->len;
+  frame.name_len = strlen (entry->name);
+  if (stat)
+    frame.stat = *stat;
+  g_array_append_val (walk->frames, frame);
+  walk->n_open++;
+
+  return TRUE;
+}
+
+/**
+ * gs_tree_walker_walk:
+ * @walker: A walker
+ * @dfd: Directory file descriptor, or -1 for the current directory
+ * @path: Root of the walk, relative to @dfd
+ * @pre_func: (allow-none): Called for each entry before its children
+ * @post_func: (allow-none): Called for each directory after its children
+ * @user_data: User data for the callbacks
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Walk the tree at @path, which may be a directory or any other
+ * file.  Entries are visited depth first, in directory order, and
+ * the root itself is visited too.  Symbolic links are never
+ * followed, except for the root with
+ * %GS_TREE_WALKER_FLAGS_FOLLOW_ROOT.  Entries deleted during the walk
+ * are skipped.
+ *
+ * Since @post_func is called after everything below a directory, it
+ * may remove the directory.
+ *
+ * If more directories are open than allowed, the remaining entries
+ * of the shallowest one are read into memory and its descriptor is
+ * closed; it is reopened as ".." of its subdirectory when the walk
+ * gets back to it, so paths longer than PATH_MAX work too.
+ *
+ * Returns: %TRUE on success
+ */
+gboolean
+gs_tree_walker_walk (GSTreeWalker      *walker,
+                     int                dfd,
+                     const char        *path,
+                     GSTreeWalkerFunc   pre_func,
+                     GSTreeWalkerFunc   post_func,
+                     gpointer           user_data,
+                     GCancellable      *cancellable,
+                     GError           **error)
+{
+  gboolean ret = FALSE;
+  GsTreeWalk walk = { 0, };
+  GSTreeWalkerEntry entry = { 0, };
+  /* The inode is needed to check reopened directories */
+  GSStatMask mask = walker->stat_mask | GS_STAT_TYPE | GS_STAT_INO;
+  GSStat st;
+  guint i;
+
+  if (dfd == -1)
+    dfd = AT_FDCWD;
+
+  walk.walker = walker;
+  walk.root_dfd = dfd;
+  walk.root_path = path;
+  walk.frames = g_array_new (FALSE, FALSE, sizeof (GsTreeFrame));
+  walk.path = g_string_new ("");
+
+  if (!gs_stat_at (dfd, path,
+                   (walker->flags & GS_TREE_WALKER_FLAGS_FOLLOW_ROOT) ? 0 : AT_SYMLINK_NOFOLLOW,
+                   mask, &st, error))
+    goto out;
+
+  entry.dfd = dfd;
+  entry.name = path;
+  entry.path = walk.path->str;
+  entry.depth = 0;
+  entry.type = IFTODT (st.mode);
+  entry.stat = walker->stat_mask ? &st : NULL;
+  if (!tree_walk_visit (&walk, &entry, &st, pre_func, user_data, cancellable, error))
+    goto out;
+
+  while (walk.frames->len > 0)
+    {
+      guint top = walk.frames->len - 1;
+      GsTreeFrame *frame;
+      const char *name;
+      guint8 type;
+      gsize parent_len;
+      gboolean have_stat = FALSE;
+
+      if (!tree_frame_ensure_fd (&walk, top, -1, error))
+        goto out;
+      frame = &g_array_index (walk.frames, GsTreeFrame, top);
+
+      if (!tree_frame_next (frame, &name, &type, cancellable, error))
+        goto out;
+
+      if (name == NULL)
+        {
+          /* The parent is needed next */
+          if (top > 0 && !tree_frame_ensure_fd (&walk, top - 1, frame->fd, error))
+            goto out;
+          tree_frame_close (&walk, frame);
+
+          if (post_func)
+            {
+              if (top == 0)
+                {
+                  entry.dfd = dfd;
+                  entry.name = path;
+                }
+              else
+                {
+                  entry.dfd = g_array_index (walk.frames, GsTreeFrame, top - 1).fd;
+                  entry.name = walk.path->str + frame->path_len - frame->name_len;
+                }
+              entry.path = walk.path->str;
+              entry.depth = top;
+              entry.type = DT_DIR;
+              entry.stat = walker->stat_mask ? &frame->stat : NULL;
+              if (!post_func (walker, &entry, user_data, error))
+                goto out;
+            }
+
+          tree_frame_clear (&walk, frame);
+          g_array_set_size (walk.frames, top);
+          if (top > 0)
+            g_string_truncate (walk.path,
+                               g_array_index (walk.frames, GsTreeFrame, top - 1).path_len);
+          continue;
+        }
+
+      parent_len = walk.path->len;
+      if (parent_len > 0)
+        g_string_append_c (walk.path, '/');
+      g_string_append (walk.path, name);
+
+      if (type == DT_UNKNOWN || walker->stat_mask)
+        {
+          GError *local_error = NULL;
+
+          if (!gs_stat_at (frame->fd, name, AT_SYMLINK_NOFOLLOW, mask, &st, &local_error))
+            {
+              if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+                {
+                  g_clear_error (&local_error);
+                  g_string_truncate (walk.path, parent_len);
+                  continue;
+                }
+              g_propagate_error (error, local_error);
+              goto out;
+            }
+          type = IFTODT (st.mode);
+          have_stat = TRUE;
+        }
+
+      entry.dfd = frame->fd;
+      entry.name = name;
+      entry.path = walk.path->str;
+      entry.depth = top + 1;
+      entry.type = type;
+      entry.stat = walker->stat_mask ? &st : NULL;
+      if (!tree_walk_visit (&walk, &entry, have_stat ? &st : NULL,
+                            pre_func, user_data, cancellable, error))
+        goto out;
+
+      if (walk.frames->len == top + 1)
+        g_string_truncate (walk.path, parent_len);
+    }
+
+  ret = TRUE;
+ out:
+  for (i = 0; i < walk.frames->len; i++)
+    tree_frame_clear (&walk, &g_array_index (walk.frames, GsTreeFrame, i));
+  g_array_free (walk.frames, TRUE);
+  g_string_free (walk.path, TRUE);
+  return ret;
+}
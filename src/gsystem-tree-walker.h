@@ -0,0 +1,95 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2012 Colin Walters <walters@verbum.org>.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __GSYSTEM_TREE_WALKER_H__
+#define __GSYSTEM_TREE_WALKER_H__
+
+#include <gio/gio.h>
+#include "gsystem-file-utils.h"
+
+G_BEGIN_DECLS
+
+/**
+ * GSTreeWalkerFlags:
+ * @GS_TREE_WALKER_FLAGS_NONE: No flags
+ * @GS_TREE_WALKER_FLAGS_FOLLOW_ROOT: If the root is a symbolic link, walk its target
+ */
+typedef enum {
+  GS_TREE_WALKER_FLAGS_NONE = 0,
+  GS_TREE_WALKER_FLAGS_FOLLOW_ROOT = (1 << 0)
+} GSTreeWalkerFlags;
+
+/**
+ * GSTreeWalkerEntry:
+ * @dfd: File descriptor of the parent directory; only valid during the callback
+ * @name: Name relative to @dfd
+ * @path: Path relative to the root of the walk; "" for the root itself
+ * @depth: Depth below the root, which is 0
+ * @type: File type, as for d_type; never DT_UNKNOWN
+ * @stat: (allow-none): Metadata, if a #GSStatMask was given
+ *
+ * An entry passed to a #GSTreeWalkerFunc.
+ */
+typedef struct {
+  int dfd;
+  const char *name;
+  const char *path;
+  guint depth;
+  guint8 type;
+  const GSStat *stat;
+} GSTreeWalkerEntry;
+
+typedef struct _GSTreeWalker GSTreeWalker;
+
+/**
+ * GSTreeWalkerFunc:
+ * @walker: The walker
+ * @entry: Entry being visited
+ * @user_data: User data
+ * @error: Error
+ *
+ * Called for an entry during gs_tree_walker_walk().  Returning
+ * %FALSE stops the walk with @error.
+ */
+typedef gboolean (*GSTreeWalkerFunc) (GSTreeWalker             *walker,
+                                      const GSTreeWalkerEntry  *entry,
+                                      gpointer                  user_data,
+                                      GError                  **error);
+
+GSTreeWalker *gs_tree_walker_new (GSTreeWalkerFlags  flags,
+                                  GSStatMask         stat_mask,
+                                  guint              max_fds);
+
+void gs_tree_walker_free (GSTreeWalker *walker);
+
+gboolean gs_tree_walker_walk (GSTreeWalker      *walker,
+                              int                dfd,
+                              const char        *path,
+                              GSTreeWalkerFunc   pre_func,
+                              GSTreeWalkerFunc   post_func,
+                              gpointer           user_data,
+                              GCancellable      *cancellable,
+                              GError           **error);
+
+void gs_tree_walker_skip_subtree (GSTreeWalker *walker);
+
+G_END_DECLS
+
+#endif
@@ -36,6 +36,7 @@ G_BEGIN_DECLS
 #include <gsystem-console.h>
 #include <gsystem-file-utils.h>
 #include <gsystem-shutil.h>
+#include <gsystem-tree-walker.h>
 #if GLIB_CHECK_VERSION(2,34,0)
 #include <gsystem-subprocess.h>
 #endif
@@ -1,6 +1,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
 
 #include <libgsystem.h>
 #include <glib-unix.h>
@@ -136,6 +139,1207 @@ test_shutil_rm_rf_random (void)
   g_assert (!g_file_query_exists (testdir, NULL));
 }
 
+static void
+setup_cp_src (void)
+{
+  GError *error = NULL;
+  gs_unref_object GFile *src = g_file_new_for_path ("cpsrc");
+  gs_unref_object GFile *dest = g_file_new_for_path ("cpdest");
+
+  (void) gs_shutil_rm_rf (dest, NULL, &error);
+  g_assert_no_error (error);
+  (void) gs_shutil_rm_rf (src, NULL, &error);
+  g_assert_no_error (error);
+
+  g_assert_cmpint (mkdir ("cpsrc", 0755), ==, 0);
+  g_assert_cmpint (mkdir ("cpsrc/sub", 0700), ==, 0);
+  g_assert_cmpint (mkdir ("cpsrc/sub/subsub", 0755), ==, 0);
+  (void) g_file_set_contents ("cpsrc/a", "hello", -1, &error);
+  g_assert_no_error (error);
+  (void) g_file_set_contents ("cpsrc/sub/b", "world", -1, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (symlink ("a", "cpsrc/l"), ==, 0);
+}
+
+static void
+check_cp_dest_and_cleanup (void)
+{
+  GError *error = NULL;
+  gs_unref_object GFile *src = g_file_new_for_path ("cpsrc");
+  gs_unref_object GFile *dest = g_file_new_for_path ("cpdest");
+  gs_free char *contents = NULL;
+  char buf[PATH_MAX];
+  ssize_t len;
+  struct stat stbuf;
+
+  (void) g_file_get_contents ("cpdest/a", &contents, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpstr (contents, ==, "hello");
+  g_clear_pointer (&contents, g_free);
+  (void) g_file_get_contents ("cpdest/sub/b", &contents, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpstr (contents, ==, "world");
+
+  g_assert_cmpint (stat ("cpdest/sub", &stbuf), ==, 0);
+  g_assert_cmpint (stbuf.st_mode & 07777, ==, 0700);
+  g_assert_cmpint (stat ("cpdest/sub/subsub", &stbuf), ==, 0);
+  g_assert (S_ISDIR (stbuf.st_mode));
+
+  len = readlink ("cpdest/l", buf, sizeof (buf) - 1);
+  g_assert_cmpint (len, ==, 1);
+  buf[len] = '\0';
+  g_assert_cmpstr (buf, ==, "a");
+
+  (void) gs_shutil_rm_rf (dest, NULL, &error);
+  g_assert_no_error (error);
+  (void) gs_shutil_rm_rf (src, NULL, &error);
+  g_assert_no_error (error);
+}
+
+static void
+test_shutil_cp_a (void)
+{
+  GError *error = NULL;
+  gs_unref_object GFile *src = g_file_new_for_path ("cpsrc");
+  gs_unref_object GFile *dest = g_file_new_for_path ("cpdest");
+
+  setup_cp_src ();
+
+  (void) gs_shutil_cp_a (src, dest, NULL, &error);
+  g_assert_no_error (error);
+
+  check_cp_dest_and_cleanup ();
+}
+
+static void
+test_shutil_cp_a_parallel (void)
+{
+  GError *error = NULL;
+  gs_unref_object GFile *src = g_file_new_for_path ("cpsrc");
+  gs_unref_object GFile *dest = g_file_new_for_path ("cpdest");
+  gs_free char *big = g_malloc0 (4 * 1024 * 1024);
+  gs_free char *contents = NULL;
+  gsize len;
+
+  setup_cp_src ();
+  big[42] = 'x';
+  (void) g_file_set_contents ("cpsrc/sub/big", big, 4 * 1024 * 1024, &error);
+  g_assert_no_error (error);
+
+  (void) gs_shutil_cp_a_parallel (src, dest, GS_SHUTIL_CP_NONE, 4, NULL, NULL, &error);
+  g_assert_no_error (error);
+
+  (void) g_file_get_contents ("cpdest/sub/big", &contents, &len, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (len, ==, 4 * 1024 * 1024);
+  g_assert (memcmp (contents, big, len) == 0);
+
+  check_cp_dest_and_cleanup ();
+}
+
+static void
+test_shutil_cp_a_durable (void)
+{
+  GError *error = NULL;
+  gs_unref_object GFile *src = g_file_new_for_path ("cpsrc");
+  gs_unref_object GFile *dest = g_file_new_for_path ("cpdest");
+  gs_free char *big = g_malloc0 (4 * 1024 * 1024);
+  gs_free char *contents = NULL;
+  gsize len;
+  guint n_workers;
+
+  for (n_workers = 1; n_workers <= 4; n_workers += 3)
+    {
+      setup_cp_src ();
+      big[42] = 'x';
+      (void) g_file_set_contents ("cpsrc/sub/big", big, 4 * 1024 * 1024, &error);
+      g_assert_no_error (error);
+
+      (void) gs_shutil_cp_a_parallel (src, dest, GS_SHUTIL_CP_DURABLE, n_workers,
+                                      NULL, NULL, &error);
+      g_assert_no_error (error);
+
+      (void) g_file_get_contents ("cpdest/sub/big", &contents, &len, &error);
+      g_assert_no_error (error);
+      g_assert_cmpuint (len, ==, 4 * 1024 * 1024);
+      g_assert (memcmp (contents, big, len) == 0);
+      g_clear_pointer (&contents, g_free);
+
+      check_cp_dest_and_cleanup ();
+    }
+}
+
+static void
+test_shutil_cp_a_hardlinks (void)
+{
+  GError *error = NULL;
+  gs_unref_object GFile *src = g_file_new_for_path ("cpsrc");
+  gs_unref_object GFile *dest = g_file_new_for_path ("cpdest");
+  struct stat src_stbuf, stbuf_a, stbuf_link;
+
+  setup_cp_src ();
+  g_assert_cmpint (link ("cpsrc/a", "cpsrc/sub/subsub/a-link"), ==, 0);
+
+  (void) gs_shutil_cp_a (src, dest, NULL, &error);
+  g_assert_no_error (error);
+
+  g_assert_cmpint (stat ("cpsrc/a", &src_stbuf), ==, 0);
+  g_assert_cmpint (stat ("cpdest/a", &stbuf_a), ==, 0);
+  g_assert_cmpint (stat ("cpdest/sub/subsub/a-link", &stbuf_link), ==, 0);
+  g_assert (stbuf_a.st_ino == stbuf_link.st_ino);
+  g_assert (stbuf_a.st_ino != src_stbuf.st_ino);
+  g_assert_cmpint (stbuf_a.st_nlink, ==, 2);
+
+  check_cp_dest_and_cleanup ();
+}
+
+static void
+test_shutil_cp_al_dedup (void)
+{
+  GError *error = NULL;
+  gs_unref_object GFile *src = g_file_new_for_path ("cpsrc");
+  gs_unref_object GFile *dest = g_file_new_for_path ("cpdest");
+  gs_unref_object GFile *store = g_file_new_for_path ("cpstore");
+
+  setup_cp_src ();
+
+  (void) gs_shutil_cp_al_dedup (src, dest, store, NULL, &error);
+  g_assert_no_error (error);
+  g_assert (g_file_query_exists (store, NULL));
+
+  check_cp_dest_and_cleanup ();
+
+  (void) gs_shutil_rm_rf (store, NULL, &error);
+  g_assert_no_error (error);
+}
+
+static void
+test_shutil_cp_al_dedup_metadata (void)
+{
+  GError *error = NULL;
+  gs_unref_object GFile *src = g_file_new_for_path ("dedupsrc");
+  gs_free char *dest_path = g_strdup_printf ("/dev/shm/gs-dedup-dest-%d", (int) getpid ());
+  gs_free char *store_path = g_strdup_printf ("/dev/shm/gs-dedup-store-%d", (int) getpid ());
+  gs_unref_object GFile *dest = g_file_new_for_path (dest_path);
+  gs_unref_object GFile *store = g_file_new_for_path (store_path);
+  const char *names[] = { "f1", "f2", "f3", "f4" };
+  struct timespec ts[2] = { { 1000, 0 }, { 1000, 0 } };
+  struct stat cwd_stbuf, shm_stbuf;
+  struct stat stbuf[G_N_ELEMENTS (names)];
+  gboolean have_xattrs;
+  guint i;
+
+  /* Deduplication only kicks in where files cannot be hardlinked */
+  if (stat (".", &cwd_stbuf) == -1 || stat ("/dev/shm", &shm_stbuf) == -1 ||
+      cwd_stbuf.st_dev == shm_stbuf.st_dev)
+    {
+      g_test_message ("no second filesystem at /dev/shm; skipping");
+      return;
+    }
+
+  (void) gs_shutil_rm_rf (src, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (mkdir ("dedupsrc", 0755), ==, 0);
+  for (i = 0; i < G_N_ELEMENTS (names); i++)
+    {
+      gs_free char *path = g_strconcat ("dedupsrc/", names[i], NULL);
+      (void) g_file_set_contents (path, "same", -1, &error);
+      g_assert_no_error (error);
+      ts[1].tv_sec = (i == 1) ? 2000 : 1000;
+      g_assert_cmpint (utimensat (AT_FDCWD, path, ts, 0), ==, 0);
+    }
+  have_xattrs = setxattr ("dedupsrc/f4", "user.gs-test", "value", 5, 0) == 0;
+  if (!have_xattrs)
+    g_assert_cmpint (errno, ==, ENOTSUP);
+
+  (void) gs_shutil_cp_al_dedup (src, dest, store, NULL, &error);
+  g_assert_no_error (error);
+
+  for (i = 0; i < G_N_ELEMENTS (names); i++)
+    {
+      gs_free char *path = g_build_filename (dest_path, names[i], NULL);
+      g_assert_cmpint (stat (path, &stbuf[i]), ==, 0);
+    }
+  /* f1 and f3 are identical; f2 differs in mtime, f4 in xattrs */
+  g_assert (stbuf[0].st_ino == stbuf[2].st_ino);
+  g_assert (stbuf[0].st_ino != stbuf[1].st_ino);
+  g_assert_cmpint (stbuf[1].st_mtim.tv_sec, ==, 2000);
+  if (have_xattrs)
+    g_assert (stbuf[0].st_ino != stbuf[3].st_ino);
+
+  (void) gs_shutil_rm_rf (dest, NULL, &error);
+  g_assert_no_error (error);
+  (void) gs_shutil_rm_rf (store, NULL, &error);
+  g_assert_no_error (error);
+  (void) gs_shutil_rm_rf (src, NULL, &error);
+  g_assert_no_error (error);
+}
+
+static void
+test_shutil_cp_a_sparse (void)
+{
+  GError *error = NULL;
+  gs_unref_object GFile *src = g_file_new_for_path ("cpsrc");
+  gs_unref_object GFile *dest = g_file_new_for_path ("cpdest");
+  const off_t size = 16 * 1024 * 1024;
+  struct stat src_stbuf, dest_stbuf;
+  int fd;
+
+  setup_cp_src ();
+  fd = open ("cpsrc/sparse", O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+  g_assert_cmpint (fd, !=, -1);
+  g_assert_cmpint (pwrite (fd, "x", 1, size / 2), ==, 1);
+  g_assert_cmpint (ftruncate (fd, size), ==, 0);
+  (void) close (fd);
+
+  (void) gs_shutil_cp_a (src, dest, NULL, &error);
+  g_assert_no_error (error);
+
+  g_assert_cmpint (stat ("cpsrc/sparse", &src_stbuf), ==, 0);
+  g_assert_cmpint (stat ("cpdest/sparse", &dest_stbuf), ==, 0);
+  g_assert_cmpint (dest_stbuf.st_size, ==, size);
+  /* Only meaningful if the filesystem supports holes at all */
+  if (src_stbuf.st_blocks * 512 < size)
+    g_assert_cmpint (dest_stbuf.st_blocks * 512, <, size);
+
+  check_cp_dest_and_cleanup ();
+}
+
+static void
+test_shutil_cp_a_sync (void)
+{
+  GError *error = NULL;
+  gs_unref_object GFile *src = g_file_new_for_path ("cpsrc");
+  gs_unref_object GFile *dest = g_file_new_for_path ("cpdest");
+  const GSShutilCpFlags flags = GS_SHUTIL_CP_SYNC | GS_SHUTIL_CP_SYNC_CHECKSUM;
+  struct stat stbuf;
+  struct timespec ts[2];
+
+  setup_cp_src ();
+
+  (void) gs_shutil_cp_a_parallel (src, dest, flags, 1, NULL, NULL, &error);
+  g_assert_no_error (error);
+
+  /* Same size and timestamps, different contents */
+  g_assert_cmpint (stat ("cpsrc/a", &stbuf), ==, 0);
+  (void) g_file_set_contents ("cpdest/a", "HELLO", -1, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (chmod ("cpdest/a", stbuf.st_mode & 07777), ==, 0);
+  ts[0] = stbuf.st_atim;
+  ts[1] = stbuf.st_mtim;
+  g_assert_cmpint (utimensat (AT_FDCWD, "cpdest/a", ts, 0), ==, 0);
+
+  g_assert_cmpint (unlink ("cpdest/sub/b"), ==, 0);
+  g_assert_cmpint (mkdir ("cpdest/extra", 0755), ==, 0);
+  (void) g_file_set_contents ("cpdest/extra/c", "", -1, &error);
+  g_assert_no_error (error);
+
+  (void) gs_shutil_cp_a_parallel (src, dest, flags, 2, NULL, NULL, &error);
+  g_assert_no_error (error);
+
+  g_assert_cmpint (access ("cpdest/extra", F_OK), ==, -1);
+
+  check_cp_dest_and_cleanup ();
+}
+
+static void
+test_shutil_rm_rf_parallel (void)
+{
+  GError *error = NULL;
+  gs_unref_object GFile *src = g_file_new_for_path ("cpsrc");
+
+  (void) gs_shutil_rm_rf_at_parallel (AT_FDCWD, "noent", 4, NULL, NULL, &error);
+  g_assert_no_error (error);
+
+  setup_cp_src ();
+  g_assert_cmpint (mkdir ("cpsrc/sub/subsub/deeper", 0755), ==, 0);
+  g_assert_cmpint (mkdir ("cpsrc/other", 0755), ==, 0);
+
+  (void) gs_shutil_rm_rf_at_parallel (AT_FDCWD, "cpsrc", 4, NULL, NULL, &error);
+  g_assert_no_error (error);
+
+  g_assert (!g_file_query_exists (src, NULL));
+}
+
+static void
+test_shutil_checksum_tree (void)
+{
+  GError *error = NULL;
+  gs_unref_object GFile *src = g_file_new_for_path ("cpsrc");
+  gs_unref_object GFile *dest = g_file_new_for_path ("cpdest");
+  gs_unref_hashtable GHashTable *checksums = NULL;
+  gs_free char *expected = NULL;
+  gs_free char *src_root = NULL;
+  gs_free char *dest_root = NULL;
+
+  setup_cp_src ();
+
+  (void) gs_shutil_checksum_tree_at (AT_FDCWD, "cpsrc", G_CHECKSUM_SHA256,
+                                     GS_SHUTIL_CHECKSUM_METADATA, 1, NULL,
+                                     &checksums, &src_root, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (g_hash_table_size (checksums), ==, 3);
+  expected = g_compute_checksum_for_string (G_CHECKSUM_SHA256, "world", -1);
+  g_assert_cmpstr (g_hash_table_lookup (checksums, "sub/b"), ==, expected);
+  g_clear_pointer (&expected, g_free);
+  /* A symbolic link is checksummed by its target */
+  expected = g_compute_checksum_for_string (G_CHECKSUM_SHA256, "a", -1);
+  g_assert_cmpstr (g_hash_table_lookup (checksums, "l"), ==, expected);
+
+  /* An exact copy has the same root, however many threads are used */
+  (void) gs_shutil_cp_a (src, dest, NULL, &error);
+  g_assert_no_error (error);
+  (void) gs_shutil_checksum_tree_at (AT_FDCWD, "cpdest", G_CHECKSUM_SHA256,
+                                     GS_SHUTIL_CHECKSUM_METADATA, 4, NULL,
+                                     NULL, &dest_root, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpstr (src_root, ==, dest_root);
+  g_clear_pointer (&dest_root, g_free);
+
+  /* Only the mode differs now */
+  g_assert_cmpint (chmod ("cpdest/sub/b", 0600), ==, 0);
+  (void) gs_shutil_checksum_tree_at (AT_FDCWD, "cpdest", G_CHECKSUM_SHA256,
+                                     GS_SHUTIL_CHECKSUM_METADATA, 4, NULL,
+                                     NULL, &dest_root, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpstr (src_root, !=, dest_root);
+
+  (void) gs_shutil_rm_rf (dest, NULL, &error);
+  g_assert_no_error (error);
+  (void) gs_shutil_rm_rf (src, NULL, &error);
+  g_assert_no_error (error);
+}
+
+static void
+test_shutil_du (void)
+{
+  GError *error = NULL;
+  gs_unref_object GFile *src = g_file_new_for_path ("cpsrc");
+  GSShutilDiskUsage usage;
+
+  setup_cp_src ();
+  g_assert_cmpint (link ("cpsrc/a", "cpsrc/sub/a-link"), ==, 0);
+
+  (void) gs_shutil_du (src, 4, NULL, &usage, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (usage.n_directories, ==, 3);
+  g_assert_cmpuint (usage.n_files, ==, 4);
+  /* The hardlink is counted once */
+  g_assert_cmpuint (usage.n_inodes, ==, 6);
+  g_assert_cmpuint (usage.apparent_bytes - usage.unique_apparent_bytes, ==, 5);
+  g_assert_cmpuint (usage.allocated_bytes, >=, usage.unique_allocated_bytes);
+
+  (void) gs_shutil_du_at (AT_FDCWD, "cpsrc/a", 1, NULL, &usage, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (usage.n_files, ==, 1);
+  g_assert_cmpuint (usage.apparent_bytes, ==, 5);
+
+  (void) gs_shutil_rm_rf (src, NULL, &error);
+  g_assert_no_error (error);
+}
+
+typedef struct {
+  GMainLoop *loop;
+  GError *error;
+  guint n_progress;
+} AsyncData;
+
+static void
+on_async_progress (const GSShutilStats *stats,
+                   gpointer             user_data)
+{
+  AsyncData *data = user_data;
+  data->n_progress++;
+}
+
+static void
+on_cp_a_done (GObject      *source,
+              GAsyncResult *result,
+              gpointer      user_data)
+{
+  AsyncData *data = user_data;
+  (void) gs_shutil_cp_a_finish (result, &data->error);
+  g_main_loop_quit (data->loop);
+}
+
+static void
+on_rm_rf_done (GObject      *source,
+               GAsyncResult *result,
+               gpointer      user_data)
+{
+  AsyncData *data = user_data;
+  (void) gs_shutil_rm_rf_finish (result, &data->error);
+  g_main_loop_quit (data->loop);
+}
+
+static void
+test_shutil_async (void)
+{
+  GError *error = NULL;
+  gs_unref_object GFile *src = g_file_new_for_path ("cpsrc");
+  gs_unref_object GFile *dest = g_file_new_for_path ("cpdest");
+  gs_unref_object GCancellable *cancellable = g_cancellable_new ();
+  AsyncData data = { 0, };
+
+  setup_cp_src ();
+  data.loop = g_main_loop_new (NULL, FALSE);
+
+  gs_shutil_cp_a_async (src, dest, G_PRIORITY_DEFAULT, on_async_progress, &data,
+                        NULL, on_cp_a_done, &data);
+  g_main_loop_run (data.loop);
+  g_assert_no_error (data.error);
+  /* At least the final report, which comes before completion */
+  g_assert_cmpuint (data.n_progress, >=, 1);
+
+  g_cancellable_cancel (cancellable);
+  gs_shutil_rm_rf_async (dest, G_PRIORITY_DEFAULT, NULL, NULL, cancellable,
+                         on_rm_rf_done, &data);
+  g_main_loop_run (data.loop);
+  g_assert_error (data.error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+  g_clear_error (&data.error);
+  g_assert (g_file_query_exists (dest, NULL));
+
+  gs_shutil_rm_rf_async (dest, G_PRIORITY_DEFAULT, NULL, NULL, NULL,
+                         on_rm_rf_done, &data);
+  g_main_loop_run (data.loop);
+  g_assert_no_error (data.error);
+  g_assert (!g_file_query_exists (dest, NULL));
+
+  g_main_loop_unref (data.loop);
+  (void) gs_shutil_rm_rf (src, NULL, &error);
+  g_assert_no_error (error);
+}
+
+static void
+on_diff (GSShutilDiffKind  kind,
+         const char       *path,
+         gpointer          user_data)
+{
+  GString *out = user_data;
+  g_string_append_printf (out, "%c%s ", "ADM"[kind], path);
+}
+
+static void
+test_shutil_diff (void)
+{
+  GError *error = NULL;
+  gs_unref_object GFile *src = g_file_new_for_path ("cpsrc");
+  gs_unref_object GFile *dest = g_file_new_for_path ("cpdest");
+  GString *out = g_string_new ("");
+
+  setup_cp_src ();
+  (void) gs_shutil_cp_a (src, dest, NULL, &error);
+  g_assert_no_error (error);
+
+  (void) gs_shutil_diff (src, dest, GS_SHUTIL_DIFF_NONE, on_diff, out, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpstr (out->str, ==, "");
+
+  (void) g_file_set_contents ("cpdest/a", "jello", -1, &error);
+  g_assert_no_error (error);
+  (void) g_file_set_contents ("cpdest/new", "", -1, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (unlink ("cpdest/sub/b"), ==, 0);
+  g_assert_cmpint (chmod ("cpdest/sub", 0755), ==, 0);
+
+  (void) gs_shutil_diff (src, dest, GS_SHUTIL_DIFF_CONTENTS, on_diff, out, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpstr (out->str, ==, "Ma Anew Msub Dsub/b ");
+
+  g_string_free (out, TRUE);
+  (void) gs_shutil_rm_rf (dest, NULL, &error);
+  g_assert_no_error (error);
+  (void) gs_shutil_rm_rf (src, NULL, &error);
+  g_assert_no_error (error);
+}
+
+static void
+test_shutil_mv (void)
+{
+  GError *error = NULL;
+  gs_unref_object GFile *src = g_file_new_for_path ("cpsrc");
+  gs_unref_object GFile *dest = g_file_new_for_path ("cpdest");
+  gs_free char *contents = NULL;
+
+  setup_cp_src ();
+  g_assert_cmpint (mkdir ("cpdest", 0755), ==, 0);
+
+  (void) gs_shutil_mv (src, dest, GS_RENAME_NOREPLACE, NULL, &error);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_EXISTS);
+  g_clear_error (&error);
+
+  /* An empty directory is replaced */
+  (void) gs_shutil_mv (src, dest, GS_RENAME_NONE, NULL, &error);
+  g_assert_no_error (error);
+  g_assert (!g_file_query_exists (src, NULL));
+
+  (void) g_file_set_contents ("mva", "a", -1, &error);
+  g_assert_no_error (error);
+  (void) g_file_set_contents ("mvb", "b", -1, &error);
+  g_assert_no_error (error);
+  if (gs_shutil_mv_at (-1, "mva", -1, "mvb", GS_RENAME_EXCHANGE, NULL, &error))
+    {
+      (void) g_file_get_contents ("mva", &contents, NULL, &error);
+      g_assert_no_error (error);
+      g_assert_cmpstr (contents, ==, "b");
+    }
+  else
+    {
+      g_assert_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED);
+      g_clear_error (&error);
+    }
+  (void) unlink ("mva");
+  (void) unlink ("mvb");
+
+  check_cp_dest_and_cleanup ();
+}
+
+static void
+on_rm_rf_background_done (GObject      *source,
+                          GAsyncResult *result,
+                          gpointer      user_data)
+{
+  AsyncData *data = user_data;
+  (void) gs_shutil_rm_rf_at_background_finish (result, &data->error);
+  g_main_loop_quit (data->loop);
+}
+
+static void
+test_shutil_swap_trees (void)
+{
+  GError *error = NULL;
+  gs_unref_object GFile *dir = g_file_new_for_path ("swapdir");
+  gs_free char *contents = NULL;
+  AsyncData data = { 0, };
+  GDir *d;
+
+  (void) gs_shutil_rm_rf (dir, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (mkdir ("swapdir", 0755), ==, 0);
+  g_assert_cmpint (mkdir ("swapdir/current", 0755), ==, 0);
+  g_assert_cmpint (mkdir ("swapdir/new", 0755), ==, 0);
+  (void) g_file_set_contents ("swapdir/current/f", "old", -1, &error);
+  g_assert_no_error (error);
+  (void) g_file_set_contents ("swapdir/new/f", "new", -1, &error);
+  g_assert_no_error (error);
+
+  if (!gs_shutil_swap_trees (AT_FDCWD, "swapdir/current", "swapdir/new", NULL, &error))
+    {
+      g_assert_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED);
+      g_clear_error (&error);
+      g_assert_cmpint (rename ("swapdir/current", "swapdir/old"), ==, 0);
+      g_assert_cmpint (rename ("swapdir/new", "swapdir/current"), ==, 0);
+      g_assert_cmpint (rename ("swapdir/old", "swapdir/new"), ==, 0);
+    }
+  (void) g_file_get_contents ("swapdir/current/f", &contents, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpstr (contents, ==, "new");
+
+  /* The name is free at once */
+  data.loop = g_main_loop_new (NULL, FALSE);
+  gs_shutil_rm_rf_at_background (AT_FDCWD, "swapdir/new", NULL,
+                                 on_rm_rf_background_done, &data);
+  g_assert_cmpint (access ("swapdir/new", F_OK), ==, -1);
+  g_main_loop_run (data.loop);
+  g_assert_no_error (data.error);
+  g_main_loop_unref (data.loop);
+
+  d = g_dir_open ("swapdir", 0, &error);
+  g_assert_no_error (error);
+  g_assert_cmpstr (g_dir_read_name (d), ==, "current");
+  g_assert (g_dir_read_name (d) == NULL);
+  g_dir_close (d);
+
+  (void) gs_shutil_rm_rf (dir, NULL, &error);
+  g_assert_no_error (error);
+}
+
+static void
+on_progress (const GSShutilStats *stats,
+             gpointer             user_data)
+{
+  guint *n_calls = user_data;
+  (*n_calls)++;
+}
+
+static void
+test_shutil_progress (void)
+{
+  GError *error = NULL;
+  gs_unref_object GFile *src = g_file_new_for_path ("cpsrc");
+  gs_unref_object GFile *dest = g_file_new_for_path ("cpdest");
+  GSShutilProgress *progress;
+  GSShutilStats stats;
+  guint n_calls = 0;
+
+  setup_cp_src ();
+
+  progress = gs_shutil_progress_new (1000, on_progress, &n_calls);
+  (void) gs_shutil_cp_a_parallel (src, dest, GS_SHUTIL_CP_NONE, 1, progress, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (n_calls, >=, 1);
+
+  gs_shutil_progress_get_stats (progress, &stats);
+  g_assert_cmpuint (stats.n_directories, ==, 2);
+  g_assert_cmpuint (stats.n_files, ==, 3);
+  g_assert_cmpuint (stats.n_copied, ==, 3);
+  g_assert_cmpuint (stats.n_bytes, ==, 10);
+  g_assert_cmpint (stats.phase_usec[GS_SHUTIL_PHASE_COPY], >, 0);
+
+  (void) gs_shutil_cp_a_parallel (src, dest, GS_SHUTIL_CP_SYNC, 2, progress, NULL, &error);
+  g_assert_no_error (error);
+  gs_shutil_progress_get_stats (progress, &stats);
+  g_assert_cmpuint (stats.n_files, ==, 6);
+  g_assert_cmpuint (stats.n_skipped, ==, 3);
+  gs_shutil_progress_free (progress);
+
+  progress = gs_shutil_progress_new (0, NULL, NULL);
+  (void) gs_shutil_rm_rf_at_parallel (AT_FDCWD, "cpdest", 2, progress, NULL, &error);
+  g_assert_no_error (error);
+  gs_shutil_progress_get_stats (progress, &stats);
+  g_assert_cmpuint (stats.n_deleted, ==, 6);
+  gs_shutil_progress_free (progress);
+
+  (void) gs_shutil_rm_rf (src, NULL, &error);
+  g_assert_no_error (error);
+}
+
+static gpointer
+get_path_cached_thread (gpointer data)
+{
+  return (gpointer) gs_file_get_path_cached (data);
+}
+
+static void
+test_path_cached_threads (void)
+{
+  gs_unref_object GFile *file = g_file_new_for_path ("/some/path");
+  GThread *threads[8];
+  const char *paths[G_N_ELEMENTS (threads)];
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (threads); i++)
+    threads[i] = g_thread_new ("path-cached", get_path_cached_thread, file);
+  for (i = 0; i < G_N_ELEMENTS (threads); i++)
+    paths[i] = g_thread_join (threads[i]);
+
+  /* Every thread gets the one string that was published */
+  for (i = 0; i < G_N_ELEMENTS (threads); i++)
+    {
+      g_assert_cmpstr (paths[i], ==, "/some/path");
+      g_assert (paths[i] == gs_file_get_path_cached (file));
+    }
+  g_assert_cmpstr (gs_file_get_basename_cached (file), ==, "path");
+}
+
+static void
+test_dirfd_iterator_batch (void)
+{
+  GError *error = NULL;
+  gs_unref_object GFile *dir = g_file_new_for_path ("batchdir");
+  GSDirFdIterator iter = { 0, };
+  gs_free guint64 *buf = g_malloc (4096);
+  guint n_entries = 0;
+  guint i;
+
+  (void) gs_shutil_rm_rf (dir, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (mkdir ("batchdir", 0755), ==, 0);
+  for (i = 0; i < 500; i++)
+    {
+      gs_free char *path = g_strdup_printf ("batchdir/entry-with-a-long-name-%u", i);
+      (void) g_file_set_contents (path, "", 0, &error);
+      g_assert_no_error (error);
+    }
+
+  (void) gs_dirfd_iterator_init_at (AT_FDCWD, "batchdir", TRUE, &iter, &error);
+  g_assert_no_error (error);
+
+  while (TRUE)
+    {
+      GSDirFdEntry *entry;
+      gsize len;
+
+      (void) gs_dirfd_iterator_next_batch (&iter, buf, 4096, &len, NULL, &error);
+      g_assert_no_error (error);
+      if (len == 0)
+        break;
+
+      for (entry = (GSDirFdEntry *) buf;
+           (char *) entry < (char *) buf + len;
+           entry = GS_DIRFD_ENTRY_NEXT (entry))
+        {
+          g_assert (g_str_has_prefix (entry->name, "entry-with-a-long-name-"));
+          g_assert (entry->type == DT_REG || entry->type == DT_UNKNOWN);
+          n_entries++;
+        }
+    }
+  g_assert_cmpuint (n_entries, ==, 500);
+
+  gs_dirfd_iterator_clear (&iter);
+  (void) gs_shutil_rm_rf (dir, NULL, &error);
+  g_assert_no_error (error);
+}
+
+static void
+test_file_enumerator_batch (void)
+{
+  GError *error = NULL;
+  gs_unref_object GFile *dir = g_file_new_for_path ("enumdir");
+  gs_unref_object GFileEnumerator *direnum = NULL;
+  guint n_entries = 0;
+  guint i;
+
+  (void) gs_shutil_rm_rf (dir, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (mkdir ("enumdir", 0755), ==, 0);
+  for (i = 0; i < 100; i++)
+    {
+      gs_free char *path = g_strdup_printf ("enumdir/f%u", i);
+      (void) g_file_set_contents (path, "", 0, &error);
+      g_assert_no_error (error);
+    }
+
+  direnum = g_file_enumerate_children (dir, G_FILE_ATTRIBUTE_STANDARD_NAME,
+                                       G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                       NULL, &error);
+  g_assert_no_error (error);
+
+  while (TRUE)
+    {
+      GPtrArray *infos;
+
+      (void) gs_file_enumerator_iterate_batch (direnum, 32, &infos, NULL, &error);
+      g_assert_no_error (error);
+      if (infos->len == 0)
+        break;
+      g_assert_cmpuint (infos->len, <=, 32);
+
+      for (i = 0; i < infos->len; i++)
+        {
+          GFileInfo *info = infos->pdata[i];
+          GFile *child;
+
+          g_assert (g_str_has_prefix (g_file_info_get_name (info), "f"));
+          if (n_entries++ % 10 != 0)
+            continue;
+
+          child = gs_file_enumerator_get_child (direnum, info);
+          g_assert (child == gs_file_enumerator_get_child (direnum, info));
+          g_assert_cmpstr (gs_file_get_basename_cached (child), ==,
+                           g_file_info_get_name (info));
+        }
+    }
+  g_assert_cmpuint (n_entries, ==, 100);
+
+  (void) gs_shutil_rm_rf (dir, NULL, &error);
+  g_assert_no_error (error);
+}
+
+static void
+test_gen_tmp_name_buf (void)
+{
+  char buf[GS_FILEUTIL_TMP_NAME_MAX];
+  char prev[GS_FILEUTIL_TMP_NAME_MAX];
+  char small[8];
+  guint i;
+
+  g_assert (!gs_fileutil_gen_tmp_name_buf ("p-", ".tmp", small, sizeof (small)));
+
+  g_assert (gs_fileutil_gen_tmp_name_buf (NULL, NULL, prev, sizeof (prev)));
+  g_assert (g_str_has_suffix (prev, ".tmp"));
+  for (i = 0; i < 100; i++)
+    {
+      g_assert (gs_fileutil_gen_tmp_name_buf ("p-", ".tmp", buf, sizeof (buf)));
+      g_assert (g_str_has_prefix (buf, "p-"));
+      g_assert_cmpuint (strlen (buf), ==, strlen ("p-") + 8 + strlen (".tmp"));
+      g_assert_cmpstr (buf, !=, prev);
+      strcpy (prev, buf);
+    }
+}
+
+static void
+test_anonymous_tmpfile (void)
+{
+  GError *error = NULL;
+  gs_unref_object GFile *dir = g_file_new_for_path ("anondir");
+  gs_free char *contents = NULL;
+  gs_free char *tmp_name = NULL;
+  GSDirFdIterator iter = { 0, };
+  struct dirent *dent;
+  guint n_entries = 0;
+  int dfd;
+  int fd;
+
+  (void) gs_shutil_rm_rf (dir, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (mkdir ("anondir", 0755), ==, 0);
+  (void) gs_file_open_dir_fd (dir, &dfd, NULL, &error);
+  g_assert_no_error (error);
+
+  (void) gs_file_open_anonymous_at (dfd, 0644, &fd, &tmp_name, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (write (fd, "one", 3), ==, 3);
+  (void) gs_file_commit_anonymous_at (dfd, fd, tmp_name, "target",
+                                      GS_RENAME_NOREPLACE, NULL, &error);
+  g_assert_no_error (error);
+  (void) close (fd);
+  g_clear_pointer (&tmp_name, g_free);
+
+  /* Replacing is only allowed without NOREPLACE */
+  (void) gs_file_open_anonymous_at (dfd, 0644, &fd, &tmp_name, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (write (fd, "two", 3), ==, 3);
+  g_assert (!gs_file_commit_anonymous_at (dfd, fd, tmp_name, "target",
+                                          GS_RENAME_NOREPLACE, NULL, &error));
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_EXISTS);
+  g_clear_error (&error);
+  (void) gs_file_commit_anonymous_at (dfd, fd, tmp_name, "target",
+                                      GS_RENAME_NONE, NULL, &error);
+  g_assert_no_error (error);
+  (void) close (fd);
+
+  (void) g_file_get_contents ("anondir/target", &contents, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpstr (contents, ==, "two");
+
+  /* No temporary names are left behind */
+  (void) gs_dirfd_iterator_init_at (dfd, ".", FALSE, &iter, &error);
+  g_assert_no_error (error);
+  while (TRUE)
+    {
+      (void) gs_dirfd_iterator_next_dent (&iter, &dent, NULL, &error);
+      g_assert_no_error (error);
+      if (dent == NULL)
+        break;
+      g_assert_cmpstr (dent->d_name, ==, "target");
+      n_entries++;
+    }
+  g_assert_cmpuint (n_entries, ==, 1);
+  gs_dirfd_iterator_clear (&iter);
+  (void) close (dfd);
+
+  (void) gs_shutil_rm_rf (dir, NULL, &error);
+  g_assert_no_error (error);
+}
+
+static void
+test_linkcopy_deferred_sync (void)
+{
+  GError *error = NULL;
+  gs_unref_object GFile *src = g_file_new_for_path ("lcsrc");
+  gs_unref_object GFile *dest = g_file_new_for_path ("lcdest");
+  gs_free char *contents = NULL;
+  int dfd;
+
+  (void) g_file_set_contents ("lcsrc", "deferred", -1, &error);
+  g_assert_no_error (error);
+  (void) gs_file_unlink (dest, NULL, NULL);
+
+  (void) gs_file_linkcopy_deferred_sync (src, dest, G_FILE_COPY_OVERWRITE, NULL, &error);
+  g_assert_no_error (error);
+
+  dfd = open (".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  g_assert_cmpint (dfd, !=, -1);
+  (void) gs_fd_sync_filesystem (dfd, NULL, &error);
+  g_assert_no_error (error);
+  (void) close (dfd);
+
+  (void) g_file_get_contents ("lcdest", &contents, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpstr (contents, ==, "deferred");
+
+  (void) gs_file_unlink (dest, NULL, &error);
+  g_assert_no_error (error);
+  (void) gs_file_unlink (src, NULL, &error);
+  g_assert_no_error (error);
+}
+
+static void
+test_linkcopy_at (void)
+{
+  GError *error = NULL;
+  gs_unref_object GFile *dir = g_file_new_for_path ("lcdir");
+  gs_free char *contents = NULL;
+  struct stat a_stbuf;
+  struct stat b_stbuf;
+  int dfd;
+
+  (void) gs_shutil_rm_rf (dir, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (mkdir ("lcdir", 0755), ==, 0);
+  (void) g_file_set_contents ("lcdir/a", "a", -1, &error);
+  g_assert_no_error (error);
+  (void) g_file_set_contents ("lcdir/c", "c", -1, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (symlink ("a", "lcdir/link"), ==, 0);
+  (void) gs_file_open_dir_fd (dir, &dfd, NULL, &error);
+  g_assert_no_error (error);
+
+  (void) gs_file_linkcopy_at (dfd, "a", dfd, "b", 0, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (fstatat (dfd, "a", &a_stbuf, 0), ==, 0);
+  g_assert_cmpint (fstatat (dfd, "b", &b_stbuf, 0), ==, 0);
+  g_assert_cmpint (a_stbuf.st_ino, ==, b_stbuf.st_ino);
+
+  g_assert (!gs_file_linkcopy_at (dfd, "c", dfd, "b", 0, NULL, &error));
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_EXISTS);
+  g_clear_error (&error);
+
+  /* Overwriting with the same inode is a no-op */
+  (void) gs_file_linkcopy_at (dfd, "a", dfd, "b", G_FILE_COPY_OVERWRITE, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (fstatat (dfd, "a", &a_stbuf, 0), ==, 0);
+  g_assert_cmpint (a_stbuf.st_nlink, ==, 2);
+
+  (void) gs_file_linkcopy_at (dfd, "c", dfd, "b", G_FILE_COPY_OVERWRITE, NULL, &error);
+  g_assert_no_error (error);
+  (void) g_file_get_contents ("lcdir/b", &contents, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpstr (contents, ==, "c");
+
+  (void) gs_file_linkcopy_at (dfd, "link", -1, "lcdir/link2", 0, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (fstatat (dfd, "link2", &b_stbuf, AT_SYMLINK_NOFOLLOW), ==, 0);
+  g_assert (S_ISLNK (b_stbuf.st_mode));
+  (void) close (dfd);
+
+  (void) gs_shutil_rm_rf (dir, NULL, &error);
+  g_assert_no_error (error);
+}
+
+static void
+test_stat_at (void)
+{
+  GError *error = NULL;
+  gs_unref_object GFile *src = g_file_new_for_path ("cpsrc");
+  GSDirFdIterator iter = { 0, };
+  struct stat stbuf;
+  GSStat st;
+  guint n_entries = 0;
+
+  setup_cp_src ();
+
+  (void) gs_stat_at (AT_FDCWD, "cpsrc/a", 0, GS_STAT_BASIC, &st, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (stat ("cpsrc/a", &stbuf), ==, 0);
+  g_assert_cmpuint (st.mask & GS_STAT_BASIC, ==, GS_STAT_BASIC);
+  g_assert (S_ISREG (st.mode));
+  g_assert_cmpuint (st.ino, ==, stbuf.st_ino);
+  g_assert_cmpuint (st.dev, ==, stbuf.st_dev);
+  g_assert_cmpuint (st.size, ==, 5);
+  g_assert_cmpint (st.mtime.sec, ==, stbuf.st_mtim.tv_sec);
+  g_assert_cmpuint (st.mtime.nsec, ==, stbuf.st_mtim.tv_nsec);
+
+  (void) gs_stat_at (AT_FDCWD, "cpsrc/noent", 0, GS_STAT_TYPE, &st, &error);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND);
+  g_clear_error (&error);
+
+  (void) gs_dirfd_iterator_init_at (AT_FDCWD, "cpsrc", TRUE, &iter, &error);
+  g_assert_no_error (error);
+  while (TRUE)
+    {
+      struct dirent *dent;
+
+      (void) gs_dirfd_iterator_next_stat (&iter, GS_STAT_TYPE | GS_STAT_SIZE,
+                                          &dent, &st, NULL, &error);
+      g_assert_no_error (error);
+      if (dent == NULL)
+        break;
+
+      if (strcmp (dent->d_name, "l") == 0)
+        {
+          g_assert (S_ISLNK (st.mode));
+          g_assert_cmpuint (st.size, ==, 1);
+        }
+      n_entries++;
+    }
+  g_assert_cmpuint (n_entries, ==, 3);
+  gs_dirfd_iterator_clear (&iter);
+
+  (void) gs_shutil_rm_rf (src, NULL, &error);
+  g_assert_no_error (error);
+}
+
+static void
+fill_pattern (guint8 *buf,
+              gsize   len,
+              off_t   offset)
+{
+  gsize i;
+
+  for (i = 0; i < len; i++)
+    buf[i] = (guint8) (((offset + i) * 31) ^ ((offset + i) >> 16));
+}
+
+static void
+test_fd_copy_data (void)
+{
+  GError *error = NULL;
+  /* More than one in-kernel copy chunk, and not a multiple of it */
+  const off_t size = 64 * 1024 * 1024 + 3 * 4096 + 17;
+  const off_t src_start = 12345;
+  const gsize bufsize = 1024 * 1024;
+  gs_free guint8 *buf = g_malloc (bufsize);
+  gs_free guint8 *expected = g_malloc (bufsize);
+  struct stat stbuf;
+  off_t offset;
+  int src_fd, dest_fd;
+
+  src_fd = open ("copydata-src", O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  g_assert_cmpint (src_fd, !=, -1);
+  for (offset = 0; offset < size; offset += bufsize)
+    {
+      gsize len = MIN (bufsize, (gsize) (size - offset));
+      fill_pattern (buf, len, offset);
+      g_assert_cmpint (pwrite (src_fd, buf, len, offset), ==, len);
+    }
+  dest_fd = open ("copydata-dest", O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  g_assert_cmpint (dest_fd, !=, -1);
+  g_assert_cmpint (write (dest_fd, "header", 6), ==, 6);
+
+  /* Both start part way in */
+  g_assert_cmpint (lseek (src_fd, src_start, SEEK_SET), ==, src_start);
+  (void) gs_fd_copy_data (src_fd, dest_fd, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (lseek (src_fd, 0, SEEK_CUR), ==, size);
+  g_assert_cmpint (lseek (dest_fd, 0, SEEK_CUR), ==, 6 + size - src_start);
+
+  g_assert_cmpint (fstat (dest_fd, &stbuf), ==, 0);
+  g_assert_cmpint (stbuf.st_size, ==, 6 + size - src_start);
+  g_assert_cmpint (pread (dest_fd, buf, 6, 0), ==, 6);
+  g_assert (memcmp (buf, "header", 6) == 0);
+  for (offset = src_start; offset < size; offset += bufsize)
+    {
+      gsize len = MIN (bufsize, (gsize) (size - offset));
+      fill_pattern (expected, len, offset);
+      g_assert_cmpint (pread (dest_fd, buf, len, 6 + offset - src_start), ==, len);
+      g_assert (memcmp (buf, expected, len) == 0);
+    }
+
+  (void) close (src_fd);
+  (void) close (dest_fd);
+  (void) unlink ("copydata-src");
+  (void) unlink ("copydata-dest");
+}
+
+static void
+test_fd_copy_all_xattrs (void)
+{
+  GError *error = NULL;
+  char value[16];
+  int src_fd, dest_fd;
+
+  (void) g_file_set_contents ("xattr-src", "", 0, &error);
+  g_assert_no_error (error);
+  (void) g_file_set_contents ("xattr-dest", "", 0, &error);
+  g_assert_no_error (error);
+
+  src_fd = open ("xattr-src", O_RDWR | O_CLOEXEC);
+  g_assert_cmpint (src_fd, !=, -1);
+  dest_fd = open ("xattr-dest", O_RDWR | O_CLOEXEC);
+  g_assert_cmpint (dest_fd, !=, -1);
+
+  if (fsetxattr (src_fd, "user.gs-test", "value", 5, 0) == -1)
+    {
+      g_assert_cmpint (errno, ==, ENOTSUP);
+      g_test_message ("user xattrs not supported here; skipping");
+    }
+  else
+    {
+      (void) gs_fd_copy_all_xattrs (src_fd, dest_fd, NULL, &error);
+      g_assert_no_error (error);
+      g_assert_cmpint (fgetxattr (dest_fd, "user.gs-test", value, sizeof (value)), ==, 5);
+      g_assert (memcmp (value, "value", 5) == 0);
+    }
+
+  (void) close (src_fd);
+  (void) close (dest_fd);
+  (void) unlink ("xattr-src");
+  (void) unlink ("xattr-dest");
+}
+
+typedef struct {
+  guint n_pre;
+  guint n_post;
+  guint max_depth;
+} TreeWalkCounts;
+
+static gboolean
+count_pre (GSTreeWalker             *walker,
+           const GSTreeWalkerEntry  *entry,
+           gpointer                  user_data,
+           GError                  **error)
+{
+  TreeWalkCounts *counts = user_data;
+  counts->n_pre++;
+  counts->max_depth = MAX (counts->max_depth, entry->depth);
+  g_assert (entry->type == DT_DIR || entry->type == DT_REG);
+  return TRUE;
+}
+
+static gboolean
+count_post (GSTreeWalker             *walker,
+            const GSTreeWalkerEntry  *entry,
+            gpointer                  user_data,
+            GError                  **error)
+{
+  TreeWalkCounts *counts = user_data;
+  struct stat stbuf;
+
+  counts->n_post++;
+  g_assert_cmpint (entry->type, ==, DT_DIR);
+  g_assert_cmpint (fstatat (entry->dfd, entry->name, &stbuf, AT_SYMLINK_NOFOLLOW), ==, 0);
+  g_assert (S_ISDIR (stbuf.st_mode));
+  return TRUE;
+}
+
+static void
+test_tree_walker (void)
+{
+  GError *error = NULL;
+  gs_unref_object GFile *src = g_file_new_for_path ("deep");
+  gs_unref_object GFile *dest = g_file_new_for_path ("deepcopy");
+  GSTreeWalker *walker;
+  TreeWalkCounts counts = { 0, };
+  GString *path = g_string_new ("deep");
+  const guint depth = 40;
+  guint i;
+
+  /* A chain of directories, each also holding a file */
+  for (i = 0; i < depth; i++)
+    {
+      g_assert_cmpint (mkdir (path->str, 0755), ==, 0);
+      g_string_append (path, "/f");
+      (void) g_file_set_contents (path->str, "x", 1, &error);
+      g_assert_no_error (error);
+      g_string_truncate (path, path->len - 2);
+      g_string_append (path, "/d");
+    }
+  g_string_free (path, TRUE);
+
+  /* Only two descriptors, so ancestors are evicted and reopened */
+  walker = gs_tree_walker_new (GS_TREE_WALKER_FLAGS_NONE, 0, 2);
+  (void) gs_tree_walker_walk (walker, AT_FDCWD, "deep", count_pre, count_post,
+                              &counts, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (counts.n_pre, ==, 2 * depth);
+  g_assert_cmpuint (counts.n_post, ==, depth);
+  g_assert_cmpuint (counts.max_depth, ==, depth);
+  gs_tree_walker_free (walker);
+
+  (void) gs_shutil_cp_a (src, dest, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (access ("deepcopy/d/d/d/d/d/d/d/d/d/f", F_OK), ==, 0);
+
+  (void) gs_shutil_rm_rf (dest, NULL, &error);
+  g_assert_no_error (error);
+  g_assert (!g_file_query_exists (dest, NULL));
+  (void) gs_shutil_rm_rf_at_parallel (AT_FDCWD, "deep", 4, NULL, NULL, &error);
+  g_assert_no_error (error);
+  g_assert (!g_file_query_exists (src, NULL));
+}
+
 int
 main (int   argc,
       char *argv[])
@@ -146,6 +1350,33 @@ main (int   argc,
   g_test_add_func ("/shutil/rmrf-file", test_shutil_rm_rf_file);
   g_test_add_func ("/shutil/rmrf-dir", test_shutil_rm_rf_file);
   g_test_add_func ("/shutil/rmrf-random", test_shutil_rm_rf_random);
+  g_test_add_func ("/shutil/cp-a", test_shutil_cp_a);
+  g_test_add_func ("/shutil/cp-a-parallel", test_shutil_cp_a_parallel);
+  g_test_add_func ("/shutil/cp-a-durable", test_shutil_cp_a_durable);
+  g_test_add_func ("/shutil/cp-a-hardlinks", test_shutil_cp_a_hardlinks);
+  g_test_add_func ("/shutil/cp-al-dedup", test_shutil_cp_al_dedup);
+  g_test_add_func ("/shutil/cp-al-dedup-metadata", test_shutil_cp_al_dedup_metadata);
+  g_test_add_func ("/shutil/cp-a-sparse", test_shutil_cp_a_sparse);
+  g_test_add_func ("/shutil/cp-a-sync", test_shutil_cp_a_sync);
+  g_test_add_func ("/shutil/rmrf-parallel", test_shutil_rm_rf_parallel);
+  g_test_add_func ("/shutil/checksum-tree", test_shutil_checksum_tree);
+  g_test_add_func ("/shutil/du", test_shutil_du);
+  g_test_add_func ("/shutil/async", test_shutil_async);
+  g_test_add_func ("/shutil/diff", test_shutil_diff);
+  g_test_add_func ("/shutil/mv", test_shutil_mv);
+  g_test_add_func ("/shutil/swap-trees", test_shutil_swap_trees);
+  g_test_add_func ("/shutil/progress", test_shutil_progress);
+  g_test_add_func ("/fileutils/path-cached-threads", test_path_cached_threads);
+  g_test_add_func ("/fileutils/dirfd-iterator-batch", test_dirfd_iterator_batch);
+  g_test_add_func ("/fileutils/file-enumerator-batch", test_file_enumerator_batch);
+  g_test_add_func ("/fileutils/gen-tmp-name-buf", test_gen_tmp_name_buf);
+  g_test_add_func ("/fileutils/anonymous-tmpfile", test_anonymous_tmpfile);
+  g_test_add_func ("/fileutils/linkcopy-deferred-sync", test_linkcopy_deferred_sync);
+  g_test_add_func ("/fileutils/linkcopy-at", test_linkcopy_at);
+  g_test_add_func ("/fileutils/stat-at", test_stat_at);
+  g_test_add_func ("/fileutils/fd-copy-data", test_fd_copy_data);
+  g_test_add_func ("/fileutils/fd-copy-all-xattrs", test_fd_copy_all_xattrs);
+  g_test_add_func ("/fileutils/tree-walker", test_tree_walker);
 
   return g_test_run ();
 }